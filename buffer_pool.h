@@ -0,0 +1,119 @@
+// buffer_pool.h
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cstring>
+#include <new>
+#include <vector>
+
+// A connection buffer: either a block from BufferPool or, for frames
+// larger than a block, an exact-size heap buffer owned by the pool.
+struct IoBuffer {
+    char* data = nullptr;
+    size_t capacity = 0;
+};
+
+// Fixed-size blocks carved from slabs that are never handed back to the
+// heap, so a connection that is closed and reopened, or a message that is
+// handed from recv to send by swapping buffers, costs no allocation.
+// allocations() counts every trip to the heap (new slabs and oversize
+// buffers); it stays flat once traffic reaches a steady state.
+class BufferPool {
+public:
+    BufferPool(size_t block_size, size_t blocks_per_slab)
+        : block_size_(block_size), blocks_per_slab_(blocks_per_slab) {}
+
+    ~BufferPool()
+    {
+        for (char* slab : slabs_) {
+            delete[] slab;
+        }
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    bool acquire(IoBuffer* buf, size_t min_capacity)
+    {
+        if (min_capacity > block_size_) {
+            buf->data = new (std::nothrow) char[min_capacity];
+            if (buf->data == nullptr) {
+                return false;
+            }
+            buf->capacity = min_capacity;
+            allocations_++;
+            return true;
+        }
+
+        if (free_.empty() && !add_slab()) {
+            return false;
+        }
+        buf->data = free_.back();
+        buf->capacity = block_size_;
+        free_.pop_back();
+        return true;
+    }
+
+    void release(IoBuffer* buf)
+    {
+        if (buf->data == nullptr) {
+            return;
+        }
+        if (buf->capacity == block_size_) {
+            free_.push_back(buf->data);
+        } else {
+            delete[] buf->data;
+        }
+        buf->data = nullptr;
+        buf->capacity = 0;
+    }
+
+    // Make buf hold at least min_capacity bytes, preserving the first
+    // `keep` bytes. Only oversize frames ever get here with a real grow.
+    bool reserve(IoBuffer* buf, size_t min_capacity, size_t keep)
+    {
+        if (buf->capacity >= min_capacity) {
+            return true;
+        }
+        IoBuffer bigger;
+        if (!acquire(&bigger, min_capacity)) {
+            return false;
+        }
+        if (keep > 0) {
+            std::memcpy(bigger.data, buf->data, keep);
+        }
+        release(buf);
+        *buf = bigger;
+        return true;
+    }
+
+    uint64_t allocations() const { return allocations_; }
+    size_t block_size() const { return block_size_; }
+
+private:
+    bool add_slab()
+    {
+        char* slab = new (std::nothrow) char[block_size_ * blocks_per_slab_];
+        if (slab == nullptr) {
+            return false;
+        }
+        slabs_.push_back(slab);
+        // Room for every block ever created, so release() never reallocates
+        free_.reserve(slabs_.size() * blocks_per_slab_);
+        for (size_t i = 0; i < blocks_per_slab_; ++i) {
+            free_.push_back(slab + i * block_size_);
+        }
+        allocations_++;
+        return true;
+    }
+
+    size_t block_size_;
+    size_t blocks_per_slab_;
+    std::vector<char*> slabs_;
+    std::vector<char*> free_;
+    uint64_t allocations_ = 0;
+};
+
+#endif // BUFFER_POOL_H
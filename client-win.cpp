@@ -41,9 +41,20 @@ struct LatencySummary {
     double throughput_rps = 0.0;
 };
 
+// Keep in sync with struct Msg in common.h
+#define MSG_MAGIC   0xEC40
+#define MSG_VERSION 1
+
 #pragma pack(push, 1)
 struct Msg {
-    uint32_t payload_size;
+    uint32_t payload_size;    // whole frame, header included
+    uint16_t magic;           // MSG_MAGIC
+    uint8_t version;          // MSG_VERSION
+    uint8_t flags;
+    uint64_t seq;             // per-connection request number
+    uint64_t client_send_ns;
+    uint64_t server_recv_ns;  // filled by the server on request only
+    uint64_t server_send_ns;
 };
 #pragma pack(pop)
 
@@ -286,7 +297,10 @@ static bool run_payload_test_on_socket(SOCKET sock,
 
     std::vector<char> send_buffer(payload_size);
     auto* header = reinterpret_cast<Msg*>(send_buffer.data());
+    std::memset(header, 0, sizeof(Msg));
     header->payload_size = payload_size;
+    header->magic = MSG_MAGIC;
+    header->version = MSG_VERSION;
     const size_t payload_bytes = payload_size - sizeof(Msg);
     char* payload_start = send_buffer.data() + sizeof(Msg);
     std::fill(payload_start, payload_start + payload_bytes, 0x42);
@@ -297,6 +311,8 @@ static bool run_payload_test_on_socket(SOCKET sock,
 
     for (int i = 0; i < msg_count; ++i) {
         const uint64_t send_ts = now_ns();
+        header->seq = static_cast<uint64_t>(i);
+        header->client_send_ns = send_ts;
 
         if (!send_all(sock, send_buffer.data(), send_buffer.size())) {
             fprintf(stderr, "send_all failed at i=%d\n", i);
@@ -311,6 +327,13 @@ static bool run_payload_test_on_socket(SOCKET sock,
         uint64_t now = now_ns();
         uint64_t rtt_ns = now - send_ts;
         rtts.push_back(rtt_ns);
+
+        const auto* reply = reinterpret_cast<const Msg*>(recv_buffer.data());
+        if (reply->seq != static_cast<uint64_t>(i)) {
+            fprintf(stderr, "reply seq %" PRIu64 " where %d was expected\n",
+                    reply->seq, i);
+            return false;
+        }
     }
 
     if (!compute_statistics(rtts, payload_size, summary)) {
@@ -6,13 +6,21 @@
 #include <cstdlib>
 #include <cstring>
 #include <cerrno>
-#include <numeric>
 #include <vector>
 #include <fstream>
 #include <string>
 #include <climits>
 #include <utility>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
 #include <unistd.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sys/epoll.h>
 #include <sys/stat.h>
 
 #include <sys/types.h>
@@ -21,8 +29,37 @@
 #include <arpa/inet.h>
 
 #include "common.h"
+#include "histogram.h"
+#include "perf_counters.h"
+#include "shm_ring.h"
+#include "transport.h"
 
 static constexpr const char* kOutputDir = "output";
+static constexpr size_t kWindowRecvBufferSize = 64 * 1024;
+static constexpr uint32_t kUdpMaxPayload = 65507;  // IPv4 datagram limit
+static constexpr uint64_t kUdpLossTimeoutNs = 100000000ull;
+static constexpr int kUdpSocketBuffer = 4 * 1024 * 1024;  // capped by net.core.[rw]mem_max
+static constexpr int kSendBatch = 64;  // TCP frames per sendmsg, two iovecs each
+static constexpr size_t kOpenLoopMinSlots = 1024;     // per-connection send ring, open loop
+static constexpr size_t kOpenLoopMaxSlots = 1u << 20;
+
+struct ClientOptions {
+    int window = 1;       // requests kept in flight per connection
+    int connections = 1;  // concurrent TCP connections
+    int threads = 1;      // load worker threads, connections spread round-robin
+    std::vector<int> cpus;  // worker i is pinned to cpus[i % cpus.size()]
+    double rate = 0.0;      // offered requests/sec over all connections, 0 = closed loop
+    bool poisson = false;   // exponential instead of fixed inter-arrival times
+    bool clock_selftest = false;
+    bool timestamping = false;  // SO_TIMESTAMPING wire RTT, ping-pong mode only
+    bool udp = false;           // datagram echo instead of TCP
+    int short_requests = 0;     // > 0: connect, do this many requests, close, repeat
+    bool linger0 = false;       // short connections end with RST instead of FIN
+    bool perf = false;          // perf_event_open counters around each measured run
+    int busy_poll_us = 0;       // > 0: spin on non-blocking sockets, see socket_busy_poll()
+    bool coalesce = true;       // load engine: all due TCP frames in one sendmsg
+    const char* shm_name = nullptr;  // ping-pong over shm_ring.h to a shm_echo responder
+};
 
 struct LatencySummary {
     uint32_t payload_size = 0;
@@ -36,141 +73,315 @@ struct LatencySummary {
     uint64_t p999_ns = 0;
     double variance_ns2 = 0.0;
     double throughput_rps = 0.0;
+    int window = 1;
+    int connections = 1;
+    int threads = 1;
+    double offered_rps = 0.0;  // --rate, 0 for closed-loop runs
+    // RTT split from the server timestamps; all 0 if the server left them empty
+    double request_path_ns = 0.0;
+    double server_ns = 0.0;
+    double response_path_ns = 0.0;
+    uint64_t server_p99_ns = 0;
+    // --timestamping: RTT between the kernel/NIC timestamps of the request
+    // leaving and the reply arriving
+    const char* wire_source = "";  // "hardware", "software" or "mixed"
+    uint64_t wire_samples = 0;
+    double wire_avg_ns = 0.0;
+    uint64_t wire_p50_ns = 0;
+    uint64_t wire_p99_ns = 0;
+    // --udp: requests never answered within kUdpLossTimeoutNs, replies
+    // overtaken by a later one, and replies arriving after being given up on
+    bool udp = false;
+    uint64_t lost = 0;
+    uint64_t reordered = 0;
+    uint64_t late = 0;
+    // --short: every transaction is socket()+connect(), K requests, close()
+    int requests_per_conn = 0;
+    double connect_avg_ns = 0.0;
+    uint64_t connect_p99_ns = 0;
+    double txn_avg_ns = 0.0;
+    uint64_t txn_p99_ns = 0;
+    double conns_per_sec = 0.0;
+    // --perf: counters of the whole client process over the measured run
+    PerfSample perf;
 };
 
-static bool send_all(int fd, const void* buffer, size_t len)
-{
-    const auto* data = static_cast<const char*>(buffer);
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t n = send(fd, data + sent, len - sent, 0);
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;  // interrupted by signal, retry
-            }
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                fprintf(stderr, "send would block\n");
-                continue;
-            }
+// Splits RTT using the server timestamps echoed in each reply. Time spent
+// in the server is exact, as both of its timestamps come from one clock.
+// The one-way paths need the offset between the client and server clocks;
+// it is estimated NTP-style from the fastest round trip seen, assuming
+// both directions took equally long on that one. Sums are kept in the raw
+// clock domains and corrected once at the end, so the offset estimate can
+// still improve while samples are recorded.
+struct PathBreakdown {
+    uint64_t count = 0;
+    long double sum_request = 0;   // server_recv_ns - client_send_ns
+    long double sum_response = 0;  // client recv time - server_send_ns
+    uint64_t min_rtt_ns = UINT64_MAX;
+    double offset_ns = 0.0;        // server clock minus client clock
+    LatencyHistogram server;
 
-            fprintf(stderr, "send failed: %s\n", strerror(errno));
-            return false;
+    void record(const Msg& reply, uint64_t recv_ns)
+    {
+        if (reply.server_recv_ns == 0 || reply.server_send_ns < reply.server_recv_ns) {
+            return;
         }
-        if (n == 0) {
-            fprintf(stderr, "send returned 0 (connection closed).\n");
-            return false;
+        const double request = static_cast<double>(
+            static_cast<int64_t>(reply.server_recv_ns - reply.client_send_ns));
+        const double response = static_cast<double>(
+            static_cast<int64_t>(recv_ns - reply.server_send_ns));
+        const uint64_t rtt = recv_ns - reply.client_send_ns;
+        if (rtt < min_rtt_ns) {
+            min_rtt_ns = rtt;
+            offset_ns = (request - response) / 2.0;
+        }
+        count++;
+        sum_request += request;
+        sum_response += response;
+        server.record(reply.server_send_ns - reply.server_recv_ns);
+    }
+
+    void merge(const PathBreakdown& other)
+    {
+        if (other.count == 0) {
+            return;
+        }
+        if (other.min_rtt_ns < min_rtt_ns) {
+            min_rtt_ns = other.min_rtt_ns;
+            offset_ns = other.offset_ns;
         }
-        sent += static_cast<size_t>(n);
+        count += other.count;
+        sum_request += other.sum_request;
+        sum_response += other.sum_response;
+        server.merge(other.server);
+    }
+
+    void summarize(LatencySummary* summary) const
+    {
+        if (count == 0) {
+            return;
+        }
+        summary->request_path_ns = static_cast<double>(sum_request / count) - offset_ns;
+        summary->response_path_ns = static_cast<double>(sum_response / count) + offset_ns;
+        summary->server_ns = server.mean();
+        summary->server_p99_ns = server.percentile(0.99);
+    }
+};
+
+// Replies must come back with the sequence number of the oldest
+// outstanding request; anything else means a lost, duplicated or
+// reordered frame
+static bool check_reply(const Msg& reply, uint64_t expected_seq)
+{
+    if (reply.magic != MSG_MAGIC || reply.version != MSG_VERSION) {
+        fprintf(stderr, "reply has bad magic 0x%04x / version %u\n",
+                reply.magic, reply.version);
+        return false;
+    }
+    if (reply.seq != expected_seq) {
+        fprintf(stderr, "reply seq %" PRIu64 " where %" PRIu64 " was expected\n",
+                reply.seq, expected_seq);
+        return false;
     }
     return true;
 }
 
-static bool recv_all(int fd, void* buffer, size_t len)
+// SO_TIMESTAMPING (--timestamping). The kernel stamps the request's last
+// byte as the driver hands it to the NIC (reported on the error queue) and
+// each received segment on arrival (reported as a control message), so
+// their difference is the RTT without the client's syscall and scheduling
+// overhead. A NIC that has timestamping switched on (e.g. hwstamp_ctl -i
+// eth0 -t 1 -r 1) adds hardware stamps, used when both ends of a pair have
+// one; loopback and veth only ever produce software stamps.
+struct PacketTimestamp {
+    uint64_t sw_ns = 0;
+    uint64_t hw_ns = 0;
+};
+
+static uint64_t timespec_ns(const timespec& ts)
 {
-    auto* data = static_cast<char*>(buffer);
-    size_t recvd = 0;
-    while (recvd < len) {
-        ssize_t n = recv(fd, data + recvd, len - recvd, 0);
-        if (n < 0) {  // recv returns -1 on error
-            if (errno == EINTR) {
-                continue;  // interrupted by signal, retry
-            }
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                fprintf(stderr, "recv would block\n");
-                continue;
-            }
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
 
-            fprintf(stderr, "recv failed: %s (errno = %d)\n",
-                    strerror(errno), errno);
-            return false;
+static void read_timestamp_cmsg(msghdr* msg, PacketTimestamp* ts)
+{
+    for (cmsghdr* cm = CMSG_FIRSTHDR(msg); cm != nullptr; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_TIMESTAMPING) {
+            continue;
         }
-        if (n == 0) {
-            fprintf(stderr, "recv returned 0 (connection closed).\n");
-            return false;
+        scm_timestamping stamps;
+        std::memcpy(&stamps, CMSG_DATA(cm), sizeof(stamps));
+        if (timespec_ns(stamps.ts[0]) != 0) {
+            ts->sw_ns = timespec_ns(stamps.ts[0]);
+        }
+        if (timespec_ns(stamps.ts[2]) != 0) {
+            ts->hw_ns = timespec_ns(stamps.ts[2]);
         }
-        recvd += static_cast<size_t>(n);
     }
-    return true;
 }
 
-static bool recv_message(int fd, std::vector<char>& buffer)
+static void drain_error_queue(int fd)
 {
-    buffer.resize(sizeof(Msg));
-    if (!recv_all(fd, buffer.data(), sizeof(Msg))) {
-        return false;
+    char control[256];
+    for (;;) {
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
     }
+}
 
-    const auto* header = reinterpret_cast<const Msg*>(buffer.data());
-    if (header->payload_size < sizeof(Msg)) {
-        std::fprintf(stderr,
-                     "server payload_size=%" PRIu32 " is smaller than header size %zu\n",
-                     header->payload_size,
-                     sizeof(Msg));
-        return false;
-    }
+// (Re)arm timestamping on fd. Re-arming restarts the OPT_ID byte counter,
+// so TX timestamp keys are offsets into the bytes sent from now on.
+// Falls back to software-only flags if the hardware ones are refused.
+static bool enable_timestamping(int fd)
+{
+    int flags = 0;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    drain_error_queue(fd);
 
-    const size_t payload_bytes = header->payload_size - sizeof(Msg);
-    buffer.resize(header->payload_size);
-    if (payload_bytes > 0 &&
-        !recv_all(fd, buffer.data() + sizeof(Msg), payload_bytes)) {
-        return false;
+    const int software = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+                         SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                         SOF_TIMESTAMPING_OPT_TSONLY;
+    const int hardware = SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                         SOF_TIMESTAMPING_RAW_HARDWARE;
+    flags = software | hardware;
+#ifdef SOF_TIMESTAMPING_OPT_ID_TCP
+    flags |= SOF_TIMESTAMPING_OPT_ID_TCP;
+#endif
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0) {
+        return true;
     }
+    flags &= ~hardware;
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0) {
+        return true;
+    }
+    perror("setsockopt SO_TIMESTAMPING");
+    return false;
+}
 
-    return true;
+static void disable_timestamping(int fd)
+{
+    int flags = 0;
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+    drain_error_queue(fd);
 }
 
-static bool compute_statistics(const std::vector<uint64_t>& rtts,
-                               uint32_t payload_size,
-                               LatencySummary* summary)
+// Take TX timestamps off the error queue until the one for `key` (offset
+// of the request's last byte) shows up, waiting up to 1 ms for a late
+// hardware stamp. Older keys are skipped.
+static bool read_tx_timestamp(int fd, uint32_t key, PacketTimestamp* ts)
 {
-    if (rtts.empty()) {
-        return false;
+    const uint64_t deadline = now_ns() + 1000000;
+    char control[256];
+    for (;;) {
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || now_ns() >= deadline) {
+                return false;
+            }
+            pollfd pfd{fd, 0, 0};  // POLLERR is always reported
+            poll(&pfd, 1, 1);
+            continue;
+        }
+
+        const sock_extended_err* err = nullptr;
+        PacketTimestamp stamp;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                err = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            }
+        }
+        read_timestamp_cmsg(&msg, &stamp);
+        if (err == nullptr || err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING ||
+            err->ee_info != SCM_TSTAMP_SND || err->ee_data != key) {
+            continue;
+        }
+        *ts = stamp;
+        return true;
     }
+}
 
-    std::vector<uint64_t> sorted = rtts;
-    std::sort(sorted.begin(), sorted.end());
+// Returns "hardware"/"software" for the clock the pair was measured on,
+// or nullptr if the two stamps have no clock in common
+static const char* wire_rtt(const PacketTimestamp& tx, const PacketTimestamp& rx,
+                            uint64_t* rtt_ns)
+{
+    if (tx.hw_ns != 0 && rx.hw_ns > tx.hw_ns) {
+        *rtt_ns = rx.hw_ns - tx.hw_ns;
+        return "hardware";
+    }
+    if (tx.sw_ns != 0 && rx.sw_ns > tx.sw_ns) {
+        *rtt_ns = rx.sw_ns - tx.sw_ns;
+        return "software";
+    }
+    return nullptr;
+}
 
-    const int count = static_cast<int>(sorted.size());
-    const uint64_t sum =
-        std::accumulate(sorted.begin(), sorted.end(), static_cast<uint64_t>(0));
-    const uint64_t min = sorted.front();
-    const uint64_t max = sorted.back();
+// The client's kernel socket transport: with rx_stamps set, reads go
+// through recvmsg() and rx keeps the timestamps of the segment that
+// completed the last one
+struct ClientSocket : KernelSocket {
+    bool rx_stamps = false;
+    PacketTimestamp rx;
 
-    const double avg = static_cast<long double>(sum) / count;
-    const auto percentile = [&](double ratio) {
-        if (sorted.empty()) {
-            return uint64_t{0};
+    explicit ClientSocket(int socket_fd) : KernelSocket{socket_fd} {}
+
+    ssize_t recv(void* buffer, size_t len)
+    {
+        if (!rx_stamps) {
+            return KernelSocket::recv(buffer, len);
         }
-        double position = ratio * (sorted.size() - 1);
-        size_t idx = static_cast<size_t>(std::llround(position));
-        if (idx >= sorted.size()) {
-            idx = sorted.size() - 1;
+        char control[256];
+        iovec iov{buffer, len};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n = recvmsg(fd, &msg, 0);
+        if (n > 0) {
+            read_timestamp_cmsg(&msg, &rx);
         }
-        return sorted[idx];
-    };
-    const uint64_t p50 = percentile(0.5);
-    const uint64_t p90 = percentile(0.9);
-    const uint64_t p99 = percentile(0.99);
-    const uint64_t p999 = percentile(0.999);
+        return n;
+    }
+};
+
+// The ping-pong loop is a template over the transport, so a socket and
+// the shared-memory channel of --shm run the same code. Only a socket has
+// packet timestamps.
+static ClientSocket* stamped_socket(ClientSocket& io) { return &io; }
+static ClientSocket* stamped_socket(ShmTransport&) { return nullptr; }
 
-    long double variance_acc = 0;
-    for (uint64_t value : sorted) {
-        const long double diff = static_cast<long double>(value) - avg;
-        variance_acc += diff * diff;
+static bool compute_statistics(const LatencyHistogram& hist,
+                               uint32_t payload_size,
+                               LatencySummary* summary)
+{
+    if (hist.count() == 0) {
+        return false;
     }
-    const double variance = static_cast<double>(variance_acc / count);
+
+    const double avg = hist.mean();
     const double throughput = (avg > 0.0) ? (1e9 / avg) : 0.0;
 
     summary->payload_size = payload_size;
-    summary->sample_count = count;
+    summary->sample_count = static_cast<int>(std::min<uint64_t>(hist.count(), INT_MAX));
     summary->avg_ns = avg;
-    summary->min_ns = min;
-    summary->max_ns = max;
-    summary->p50_ns = p50;
-    summary->p90_ns = p90;
-    summary->p99_ns = p99;
-    summary->p999_ns = p999;
-    summary->variance_ns2 = variance;
+    summary->min_ns = hist.min();
+    summary->max_ns = hist.max();
+    summary->p50_ns = hist.percentile(0.5);
+    summary->p90_ns = hist.percentile(0.9);
+    summary->p99_ns = hist.percentile(0.99);
+    summary->p999_ns = hist.percentile(0.999);
+    summary->variance_ns2 = hist.variance();
     summary->throughput_rps = throughput;
     return true;
 }
@@ -188,7 +399,43 @@ static void print_statistics(const LatencySummary& s)
     printf("Minimum: %" PRIu64 " ns (%.3f us)\n", s.min_ns, s.min_ns / 1000.0);
     printf("Maximum: %" PRIu64 " ns (%.3f us)\n", s.max_ns, s.max_ns / 1000.0);
     printf("Variance: %.2f ns^2\n", s.variance_ns2);
-    printf("Throughput: %.2f requests/sec\n", s.throughput_rps);
+    if (s.requests_per_conn > 0) {
+        printf("Short connections: %d request(s) each on %d thread(s), %.2f conns/sec\n",
+               s.requests_per_conn, s.threads, s.conns_per_sec);
+        printf("Connect: avg %.0f ns, p99 %" PRIu64 " ns; transaction: avg %.0f ns, p99 %"
+               PRIu64 " ns\n",
+               s.connect_avg_ns, s.connect_p99_ns, s.txn_avg_ns, s.txn_p99_ns);
+        printf("Throughput: %.2f requests/sec (measured over wall time)\n",
+               s.throughput_rps);
+    } else if (s.offered_rps > 0.0) {
+        printf("Connections: %d on %d thread(s), open loop at %.2f requests/sec\n",
+               s.connections, s.threads, s.offered_rps);
+        printf("Throughput: %.2f requests/sec (measured over wall time)\n",
+               s.throughput_rps);
+    } else if (s.window > 1 || s.connections > 1) {
+        printf("Connections: %d on %d thread(s), window %d per connection\n",
+               s.connections, s.threads, s.window);
+        printf("Throughput: %.2f requests/sec (measured over wall time)\n",
+               s.throughput_rps);
+    } else {
+        printf("Throughput: %.2f requests/sec\n", s.throughput_rps);
+    }
+    if (s.server_ns > 0.0 || s.request_path_ns != 0.0) {
+        printf("RTT split (avg): request path %.0f ns, server %.0f ns (p99 %" PRIu64
+               " ns), response path %.0f ns\n",
+               s.request_path_ns, s.server_ns, s.server_p99_ns, s.response_path_ns);
+    }
+    if (s.udp) {
+        const uint64_t total = s.sample_count + s.lost;
+        printf("UDP: lost %" PRIu64 " (%.3f%%), reordered %" PRIu64 ", late %" PRIu64 "\n",
+               s.lost, total ? 100.0 * s.lost / total : 0.0, s.reordered, s.late);
+    }
+    if (s.wire_samples > 0) {
+        printf("Wire RTT (%s timestamps, %" PRIu64 " samples): avg %.0f ns, p50 %" PRIu64
+               " ns, p99 %" PRIu64 " ns; client overhead avg %.0f ns\n",
+               s.wire_source, s.wire_samples, s.wire_avg_ns, s.wire_p50_ns, s.wire_p99_ns,
+               s.avg_ns - s.wire_avg_ns);
+    }
 }
 
 static bool validate_payload_args(uint32_t payload_size, int msg_count)
@@ -206,24 +453,40 @@ static bool validate_payload_args(uint32_t payload_size, int msg_count)
     return true;
 }
 
-static int connect_tcp(const char* server_ip, int port)
+static bool make_server_addr(const char* server_ip, int port, sockaddr_in* addr)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        perror("socket");
-        return -1;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &addr->sin_addr) <= 0) {
+        perror("inet_pton");
+        return false;
     }
+    return true;
+}
 
+// A connected UDP socket when udp is set: send/recv then talk to the
+// server only, and ICMP port-unreachable surfaces as ECONNREFUSED
+static int connect_server(const char* server_ip, int port, bool udp = false)
+{
     struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(fd);
+    if (!make_server_addr(server_ip, port, &addr)) {
         return -1;
     }
 
+    int fd = socket(AF_INET, udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (udp) {
+        // A window of large datagrams overflows the default buffers
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &kUdpSocketBuffer, sizeof(kUdpSocketBuffer));
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &kUdpSocketBuffer, sizeof(kUdpSocketBuffer));
+    } else {
+        socket_nodelay(fd);  // coalesced sends end in a short tail too
+    }
+
     if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("connect");
         close(fd);
@@ -232,63 +495,133 @@ static int connect_tcp(const char* server_ip, int port)
     return fd;
 }
 
-static bool run_payload_test_on_fd(int fd,
-                                   const char* server_ip,
-                                   int port,
-                                   uint32_t payload_size,
-                                   int msg_count,
-                                   LatencySummary* summary,
-                                   std::vector<uint64_t>* samples,
-                                   bool print_result = true,
-                                   bool skip_validation = false)
+// --busy-poll: socket options plus O_NONBLOCK, so transport_recv_all()
+// and transport_send_all() spin instead of sleeping. A refused option is reported once.
+static bool enable_busy_poll(int fd, int usecs, bool tcp)
+{
+    static std::atomic<bool> warned{false};
+    if (socket_busy_poll(fd, usecs, tcp ? 1 : 0) > 0 && !warned.exchange(true)) {
+        fprintf(stderr, "busy-poll: socket option refused (%s); raising SO_BUSY_POLL "
+                "above net.core.busy_read needs CAP_NET_ADMIN\n", strerror(errno));
+    }
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl O_NONBLOCK");
+        return false;
+    }
+    return true;
+}
+
+template <typename Transport>
+static bool run_payload_test(Transport& io,
+                             const char* server_ip,
+                             int port,
+                             uint32_t payload_size,
+                             int msg_count,
+                             LatencySummary* summary,
+                             LatencyHistogram* hist,
+                             bool timestamping,
+                             bool print_result = true,
+                             bool skip_validation = false)
 {
     if (!skip_validation && !validate_payload_args(payload_size, msg_count)) {
         return false;
     }
 
     if (print_result) {
-        printf("\nConnected to %s:%d with payload_size=%" PRIu32
+        char peer[128];
+        snprintf(peer, sizeof(peer), port > 0 ? "%s:%d" : "%s", server_ip, port);
+        printf("\nConnected to %s with payload_size=%" PRIu32
                ", sending %d messages...\n",
-               server_ip, port, payload_size, msg_count);
+               peer, payload_size, msg_count);
     }
 
     std::vector<char> send_buffer(payload_size);
     auto* header = reinterpret_cast<Msg*>(send_buffer.data());
-    header->payload_size = payload_size;
+    msg_init(header, payload_size, MSG_FLAG_SERVER_TS);
     const size_t payload_bytes = payload_size - sizeof(Msg);
     char* payload_start = send_buffer.data() + sizeof(Msg);
     std::fill(payload_start, payload_start + payload_bytes, 0x42);
 
     std::vector<char> recv_buffer;
-    std::vector<uint64_t> rtts;
-    rtts.reserve(msg_count);
+    hist->reset();
+    PathBreakdown paths;
+
+    ClientSocket* sock = stamped_socket(io);
+    if (timestamping && (sock == nullptr || !enable_timestamping(sock->fd))) {
+        fprintf(stderr, "SO_TIMESTAMPING unavailable, reporting application RTT only\n");
+        timestamping = false;
+    }
+    if (timestamping) {
+        sock->rx_stamps = true;
+    }
+    LatencyHistogram wire;
+    uint64_t bytes_sent = 0;
+    uint64_t wire_hw = 0;
+    uint64_t wire_sw = 0;
 
     for (int i = 0; i < msg_count; ++i) {
         const uint64_t send_ts = now_ns();
+        header->seq = static_cast<uint64_t>(i);
+        header->client_send_ns = send_ts;
 
-        if (!send_all(fd, send_buffer.data(), send_buffer.size())) {
-            fprintf(stderr, "send_all failed at i=%d\n", i);
+        if (!transport_send_all(io, send_buffer.data(), send_buffer.size())) {
+            fprintf(stderr, "send failed at i=%d: %s\n", i, transport_strerror(errno));
             return false;
         }
 
-        if (!recv_message(fd, recv_buffer)) {
-            fprintf(stderr, "recv_message failed at i=%d\n", i);
+        if (timestamping) {
+            sock->rx = PacketTimestamp{};
+        }
+        if (!transport_recv_message(io, recv_buffer)) {
+            fprintf(stderr, "recv failed at i=%d: %s\n", i, transport_strerror(errno));
             return false;
         }
 
         uint64_t now = now_ns();
         uint64_t rtt_ns = now - send_ts;
-        rtts.push_back(rtt_ns);
+        hist->record(rtt_ns);
+
+        if (timestamping) {
+            bytes_sent += send_buffer.size();
+            PacketTimestamp tx;
+            uint64_t wire_ns = 0;
+            const char* source = nullptr;
+            if (read_tx_timestamp(sock->fd, static_cast<uint32_t>(bytes_sent - 1), &tx)) {
+                source = wire_rtt(tx, sock->rx, &wire_ns);
+            }
+            if (source != nullptr) {
+                wire.record(wire_ns);
+                (source[0] == 'h' ? wire_hw : wire_sw)++;
+            }
+        }
+
+        Msg reply;
+        std::memcpy(&reply, recv_buffer.data(), sizeof(reply));
+        if (!check_reply(reply, static_cast<uint64_t>(i))) {
+            return false;
+        }
+        paths.record(reply, now);
     }
 
-    if (!compute_statistics(rtts, payload_size, summary)) {
+    if (!compute_statistics(*hist, payload_size, summary)) {
         fprintf(stderr, "No RTT data collected for payload_size=%" PRIu32 "\n",
                 payload_size);
         return false;
     }
+    paths.summarize(summary);
 
-    if (samples) {
-        *samples = std::move(rtts);
+    if (timestamping) {
+        sock->rx_stamps = false;
+        disable_timestamping(sock->fd);
+        summary->wire_samples = wire.count();
+        summary->wire_avg_ns = wire.mean();
+        summary->wire_p50_ns = wire.percentile(0.5);
+        summary->wire_p99_ns = wire.percentile(0.99);
+        summary->wire_source = wire_hw == 0 ? "software" : (wire_sw == 0 ? "hardware" : "mixed");
+        if (wire.count() == 0) {
+            fprintf(stderr, "SO_TIMESTAMPING enabled but no timestamp pairs were delivered\n");
+        }
     }
 
     if (print_result) {
@@ -297,6 +630,846 @@ static bool run_payload_test_on_fd(int fd,
     return true;
 }
 
+// One pipelined connection of the load engine. TCP keeps replies in
+// order, so the i-th reply carries seq i and is matched with the send
+// timestamp of the i-th request, kept in a ring indexed by
+// request % send_ts.size().
+//
+// In open-loop mode the timestamp is the time the request was *scheduled*
+// for, not when send() ran: if the server stalls, requests queue up on the
+// client and the wait counts against latency (coordinated omission). The
+// ring is sized for the requests the rate puts in flight within
+// kUdpLossTimeoutNs (open_loop_slots()); over TCP, a full ring holds back
+// further sends, which still count from their scheduled time.
+//
+// Over UDP, replies may be lost or reordered, so they are matched by seq:
+// slot_seq[i] names the request whose timestamp is in send_ts[i], or -1
+// once it was answered or given up on. An open-loop send that finds its
+// slot still taken counts the older request as lost; a reply to it that
+// turns up afterwards counts as late.
+struct LoadConn {
+    int fd = -1;
+    int sent = 0;
+    int received = 0;
+    int lost = 0;
+    bool done = false;
+    int built = 0;           // requests stamped; [sent, built) not fully written yet
+    size_t send_offset = 0;  // bytes of request `sent` already written
+    std::vector<char> request;  // header rewritten for every request
+    Msg batch[kSendBatch];      // TCP: headers of [sent, built), at seq % kSendBatch
+    std::vector<uint64_t> send_ts;
+    std::vector<char> recv_buffer;
+    size_t recv_bytes = 0;
+    uint64_t next_send_ns = 0;  // open loop: intended time of request `sent`
+    std::mt19937_64 rng;
+    std::vector<int64_t> slot_seq;  // UDP only
+    int oldest = 0;                 // UDP: lowest seq that may be outstanding
+    int64_t highest_seq = -1;       // UDP: highest seq answered so far
+    uint64_t reordered = 0;
+    uint64_t late = 0;
+};
+
+// Read-only description of one load run, shared by all workers
+struct LoadParams {
+    int msg_count = 0;  // per connection
+    int window = 1;
+    double interval_ns = 0.0;  // open loop: mean gap between sends per connection
+    bool poisson = false;
+    bool udp = false;
+    uint64_t seq_base = 0;  // UDP: first seq of this run, see run_load_test()
+    int busy_poll_us = 0;
+    bool coalesce = true;
+    uint64_t start_ns = 0;
+};
+
+static bool open_loop(const LoadParams& params)
+{
+    return params.interval_ns > 0.0;
+}
+
+static void schedule_next_send(LoadConn& conn, const LoadParams& params)
+{
+    double gap = params.interval_ns;
+    if (params.poisson) {
+        std::exponential_distribution<double> dist(1.0 / params.interval_ns);
+        gap = dist(conn.rng);
+    }
+    conn.next_send_ns += static_cast<uint64_t>(gap);
+}
+
+// A worker thread owns a subset of the connections and its own latency
+// histogram; the main thread merges the histograms after join.
+struct LoadWorker {
+    std::vector<LoadConn> conns;
+    LatencyHistogram hist;
+    PathBreakdown paths;
+    int cpu = -1;
+    bool ok = true;
+};
+
+// Send and receive on one connection until neither direction can make
+// progress, as required by edge-triggered epoll.
+// Returns false on a socket or framing error.
+static bool pump_conn(LoadConn& conn, const LoadParams& params, LoadWorker& worker)
+{
+    std::vector<char>& request = conn.request;
+    const size_t ring = conn.send_ts.size();
+
+    for (;;) {
+        bool progressed = false;
+
+        // 1) Top the window up, or in open loop stamp everything that is
+        // due, up to one batch ahead of what has been written
+        while (conn.built < params.msg_count && conn.built - conn.sent < kSendBatch &&
+               static_cast<size_t>(conn.built - conn.received) < ring) {
+            if (open_loop(params)) {
+                if (conn.next_send_ns > now_ns()) {
+                    break;
+                }
+            } else if (conn.built - conn.received >= params.window) {
+                break;
+            }
+            const uint64_t now = now_ns();
+            if (open_loop(params)) {
+                conn.send_ts[conn.built % ring] = conn.next_send_ns;
+                schedule_next_send(conn, params);
+            } else {
+                conn.send_ts[conn.built % ring] = now;
+            }
+            Msg& header = conn.batch[conn.built % kSendBatch];
+            std::memcpy(&header, request.data(), sizeof(header));
+            header.seq = static_cast<uint64_t>(conn.built);
+            header.client_send_ns = now;
+            conn.built++;
+        }
+
+        // 2) Write them. Each frame is its own header plus the shared
+        // payload; coalesced, one sendmsg carries every stamped frame,
+        // otherwise each frame gets its own, with MSG_MORE on all but the
+        // last so the stack still packs them into full segments.
+        while (conn.sent < conn.built) {
+            iovec iov[2 * kSendBatch];
+            int iovcnt = 0;
+            size_t skip = conn.send_offset;
+            const int last = params.coalesce ? conn.built : conn.sent + 1;
+            for (int i = conn.sent; i < last; ++i) {
+                char* header = reinterpret_cast<char*>(&conn.batch[i % kSendBatch]);
+                if (skip < sizeof(Msg)) {
+                    iov[iovcnt++] = iovec{header + skip, sizeof(Msg) - skip};
+                    skip = 0;
+                } else {
+                    skip -= sizeof(Msg);
+                }
+                if (request.size() > sizeof(Msg) + skip) {
+                    iov[iovcnt++] = iovec{request.data() + sizeof(Msg) + skip,
+                                          request.size() - sizeof(Msg) - skip};
+                }
+                skip = 0;
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = static_cast<size_t>(iovcnt);
+            const int flags = last < conn.built ? MSG_NOSIGNAL | MSG_MORE : MSG_NOSIGNAL;
+            ssize_t n = sendmsg(conn.fd, &msg, flags);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                fprintf(stderr, "send failed at i=%d: %s\n", conn.sent, strerror(errno));
+                return false;
+            }
+            progressed = true;
+            size_t written = static_cast<size_t>(n);
+            while (written > 0) {
+                const size_t rest = request.size() - conn.send_offset;
+                if (written < rest) {
+                    conn.send_offset += written;
+                    break;
+                }
+                written -= rest;
+                conn.send_offset = 0;
+                conn.sent++;
+            }
+        }
+
+        // 3) Drain every reply that has arrived
+        while (conn.received < conn.sent) {
+            ssize_t n = recv(conn.fd, conn.recv_buffer.data() + conn.recv_bytes,
+                             conn.recv_buffer.size() - conn.recv_bytes, 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                fprintf(stderr, "recv failed: %s (errno = %d)\n",
+                        strerror(errno), errno);
+                return false;
+            }
+            if (n == 0) {
+                fprintf(stderr, "recv returned 0 (connection closed).\n");
+                return false;
+            }
+            progressed = true;
+            conn.recv_bytes += static_cast<size_t>(n);
+
+            const uint64_t now = now_ns();
+            size_t frames = 0;
+            size_t need = 0;
+            long complete = scan_frames(conn.recv_buffer.data(), conn.recv_bytes,
+                                        &frames, &need);
+            if (complete < 0) {
+                fprintf(stderr, "server payload_size is smaller than header size %zu\n",
+                        sizeof(Msg));
+                return false;
+            }
+            if (static_cast<int>(frames) > conn.sent - conn.received) {
+                fprintf(stderr, "reply without an outstanding request\n");
+                return false;
+            }
+            size_t pos = 0;
+            for (size_t f = 0; f < frames; ++f) {
+                Msg reply;
+                std::memcpy(&reply, conn.recv_buffer.data() + pos, sizeof(reply));
+                if (!check_reply(reply, static_cast<uint64_t>(conn.received))) {
+                    return false;
+                }
+                worker.hist.record(now - conn.send_ts[conn.received % ring]);
+                worker.paths.record(reply, now);
+                conn.received++;
+                pos += reply.payload_size;
+            }
+            conn.recv_bytes -= static_cast<size_t>(complete);
+            std::memmove(conn.recv_buffer.data(), conn.recv_buffer.data() + complete,
+                         conn.recv_bytes);
+            if (need > conn.recv_buffer.size()) {
+                conn.recv_buffer.resize(need);
+            }
+        }
+
+        if (!progressed) {
+            return true;
+        }
+    }
+}
+
+// Give up on requests unanswered for kUdpLossTimeoutNs and step past
+// answered ones, oldest first; seqs go out in order, so their send times
+// do too. Returns the number of requests newly counted as lost.
+static int expire_udp_requests(LoadConn& conn, uint64_t now)
+{
+    const size_t ring = conn.send_ts.size();
+    int expired = 0;
+    while (conn.oldest < conn.sent) {
+        const size_t slot = conn.oldest % ring;
+        if (conn.slot_seq[slot] == conn.oldest) {
+            if (now - conn.send_ts[slot] < kUdpLossTimeoutNs) {
+                break;
+            }
+            conn.slot_seq[slot] = -1;
+            conn.lost++;
+            expired++;
+        }
+        conn.oldest++;
+    }
+    return expired;
+}
+
+// UDP variant of pump_conn(): one datagram per request and per reply.
+// The window counts from the oldest unresolved request, so a slot is only
+// reused once its request was answered or expired.
+static bool pump_udp_conn(LoadConn& conn, const LoadParams& params, LoadWorker& worker)
+{
+    std::vector<char>& request = conn.request;
+    const size_t ring = conn.send_ts.size();
+
+    for (;;) {
+        bool progressed = false;
+        expire_udp_requests(conn, now_ns());
+
+        while (conn.sent < params.msg_count) {
+            const uint64_t now = now_ns();
+            if (open_loop(params)) {
+                if (conn.next_send_ns > now) {
+                    break;
+                }
+            } else if (conn.sent - conn.oldest >= params.window) {
+                break;
+            }
+            const size_t slot = conn.sent % ring;
+            auto* header = reinterpret_cast<Msg*>(request.data());
+            header->seq = params.seq_base + static_cast<uint64_t>(conn.sent);
+            header->client_send_ns = now;
+            ssize_t n = send(conn.fd, request.data(), request.size(), 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                    break;
+                }
+                fprintf(stderr, "send failed at i=%d: %s\n", conn.sent, strerror(errno));
+                return false;
+            }
+            if (open_loop(params)) {
+                conn.send_ts[slot] = conn.next_send_ns;
+                schedule_next_send(conn, params);
+            } else {
+                conn.send_ts[slot] = now;
+            }
+            if (conn.slot_seq[slot] >= 0) {
+                conn.lost++;  // open loop outran the ring; see LoadConn
+            }
+            conn.slot_seq[slot] = conn.sent;
+            conn.sent++;
+            progressed = true;
+        }
+
+        for (;;) {
+            ssize_t n = recv(conn.fd, conn.recv_buffer.data(), conn.recv_buffer.size(), 0);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                // e.g. ECONNREFUSED: nothing is listening on the server port
+                fprintf(stderr, "recv failed: %s (errno = %d)\n", strerror(errno), errno);
+                return false;
+            }
+            progressed = true;
+            const uint64_t now = now_ns();
+
+            Msg reply;
+            if (static_cast<size_t>(n) < sizeof(Msg)) {
+                conn.late++;
+                continue;
+            }
+            std::memcpy(&reply, conn.recv_buffer.data(), sizeof(reply));
+            const int64_t seq = static_cast<int64_t>(reply.seq - params.seq_base);
+            const size_t slot = static_cast<size_t>(seq) % ring;
+            if (reply.magic != MSG_MAGIC || reply.seq < params.seq_base ||
+                seq >= conn.sent || conn.slot_seq[slot] != seq) {
+                conn.late++;  // duplicate, or answered after it expired
+                continue;
+            }
+            worker.hist.record(now - conn.send_ts[slot]);
+            worker.paths.record(reply, now);
+            conn.slot_seq[slot] = -1;
+            conn.received++;
+            if (seq < conn.highest_seq) {
+                conn.reordered++;
+            } else {
+                conn.highest_seq = seq;
+            }
+        }
+
+        if (!progressed) {
+            return true;
+        }
+    }
+}
+
+static void run_load_worker(LoadWorker* worker, const LoadParams* params,
+                            const std::atomic<bool>* start)
+{
+    if (worker->cpu >= 0) {
+        pin_current_thread(worker->cpu);
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        worker->ok = false;
+        return;
+    }
+    for (LoadConn& conn : worker->conns) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = &conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev) < 0) {
+            perror("epoll_ctl");
+            worker->ok = false;
+            close(epfd);
+            return;
+        }
+    }
+
+    while (!start->load(std::memory_order_acquire)) {
+    }
+
+    size_t finished = 0;
+    auto service = [&](LoadConn& conn) {
+        if (conn.done) {
+            return;
+        }
+        const bool ok = params->udp ? pump_udp_conn(conn, *params, *worker)
+                                    : pump_conn(conn, *params, *worker);
+        if (!ok) {
+            worker->ok = false;
+            return;
+        }
+        if (conn.received + conn.lost == params->msg_count) {
+            conn.done = true;
+            finished++;
+        }
+    };
+
+    for (LoadConn& conn : worker->conns) {
+        if (open_loop(*params)) {
+            conn.next_send_ns += params->start_ns;
+        }
+        service(conn);
+    }
+
+    // Closed loop sleeps until a socket is ready. Open loop must also wake
+    // for sends that fall due, so it spins on a zero timeout instead: a
+    // millisecond epoll timeout would be far too coarse for the schedule.
+    // UDP wakes every millisecond at least, to expire lost requests.
+    // Busy-poll mode spins too, polling the NIC queues on every call when
+    // the kernel supports per-epoll busy polling.
+    const bool spin = open_loop(*params) || params->busy_poll_us > 0;
+    const int timeout_ms = spin ? 0 : (params->udp ? 1 : -1);
+    static std::atomic<bool> epoll_warned{false};
+    if (params->busy_poll_us > 0 && epoll_busy_poll(epfd, params->busy_poll_us) < 0 &&
+        !epoll_warned.exchange(true)) {
+        fprintf(stderr, "busy-poll: epoll busy polling unavailable (%s), needs Linux 6.9+\n",
+                strerror(errno));
+    }
+    std::vector<epoll_event> events(worker->conns.size());
+    while (worker->ok && finished < worker->conns.size()) {
+        int n = epoll_wait(epfd, events.data(), static_cast<int>(events.size()), timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            worker->ok = false;
+            break;
+        }
+        for (int i = 0; i < n && worker->ok; ++i) {
+            service(*static_cast<LoadConn*>(events[i].data.ptr));
+        }
+        if (open_loop(*params)) {
+            const uint64_t now = now_ns();
+            for (LoadConn& conn : worker->conns) {
+                if (!worker->ok) {
+                    break;
+                }
+                if (conn.sent < params->msg_count && conn.next_send_ns <= now) {
+                    service(conn);
+                }
+            }
+        }
+        if (params->udp) {
+            const uint64_t now = now_ns();
+            for (LoadConn& conn : worker->conns) {
+                if (worker->ok && !conn.done && expire_udp_requests(conn, now) > 0) {
+                    service(conn);
+                }
+            }
+        }
+    }
+
+    close(epfd);
+}
+
+// Open loop: send ring slots per connection, for the requests its share
+// of the rate puts in flight over kUdpLossTimeoutNs, twice over, as a
+// power of two. Memory stays bounded however long the run is.
+static size_t open_loop_slots(double interval_ns)
+{
+    const double in_flight = 2.0 * static_cast<double>(kUdpLossTimeoutNs) / interval_ns;
+    size_t slots = kOpenLoopMinSlots;
+    while (static_cast<double>(slots) < in_flight && slots < kOpenLoopMaxSlots) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+// Pipelined, multi-connection variant of run_payload_test(): every
+// connection keeps `window` requests in flight and sends msg_count of them.
+// With --rate the run is open loop instead: each connection sends on its own
+// fixed (or Poisson) timeline at rate/connections, regardless of replies,
+// and latency is measured from the scheduled send time.
+// Connections are spread round-robin over worker threads, each pinned to
+// opts.cpus[i % n] when a CPU list is given. Latency is per request;
+// throughput is messages over wall time, not 1/avg latency.
+static bool run_load_test(const std::vector<int>& fds,
+                          const char* server_ip,
+                          int port,
+                          uint32_t payload_size,
+                          int msg_count,
+                          const ClientOptions& opts,
+                          LatencySummary* summary,
+                          LatencyHistogram* hist,
+                          bool print_result = true)
+{
+    if (!validate_payload_args(payload_size, msg_count)) {
+        return false;
+    }
+    if (opts.udp && payload_size > kUdpMaxPayload) {
+        fprintf(stderr, "UDP payload_size must be <= %" PRIu32 " bytes\n", kUdpMaxPayload);
+        return false;
+    }
+
+    const int thread_count = std::min<int>(opts.threads, static_cast<int>(fds.size()));
+    if (print_result) {
+        printf("\nConnected to %s:%d with payload_size=%" PRIu32
+               ", sending %d messages on each of %zu %s "
+               "with window=%d, threads=%d...\n",
+               server_ip, port, payload_size, msg_count, fds.size(),
+               opts.udp ? "UDP socket(s)" : "connection(s)", opts.window, thread_count);
+        if (opts.rate > 0.0) {
+            printf("Open loop: %.2f requests/sec offered, %s inter-arrival\n",
+                   opts.rate, opts.poisson ? "poisson" : "constant");
+        }
+    }
+
+    std::vector<char> request(payload_size);
+    auto* header = reinterpret_cast<Msg*>(request.data());
+    msg_init(header, payload_size, MSG_FLAG_SERVER_TS);
+    const size_t payload_bytes = payload_size - sizeof(Msg);
+    char* payload_start = request.data() + sizeof(Msg);
+    std::fill(payload_start, payload_start + payload_bytes, 0x42);
+
+    LoadParams params;
+    params.msg_count = msg_count;
+    params.window = opts.window;
+    params.poisson = opts.poisson;
+    params.udp = opts.udp;
+    params.busy_poll_us = opts.busy_poll_us;
+    params.coalesce = opts.coalesce;
+    // Sockets are reused across payload sizes, so a UDP reply given up on
+    // in one run may still turn up in the next; giving every run its own
+    // seq range keeps it from matching a new request
+    static uint64_t next_seq_base = 0;
+    params.seq_base = next_seq_base;
+    next_seq_base += static_cast<uint64_t>(msg_count);
+    if (opts.rate > 0.0) {
+        params.interval_ns = 1e9 * fds.size() / opts.rate;
+    }
+
+    std::vector<LoadWorker> workers(thread_count);
+    for (size_t i = 0; i < fds.size(); ++i) {
+        LoadConn conn;
+        conn.fd = fds[i];
+        conn.request = request;
+        if (open_loop(params)) {
+            // Stagger the connections so the aggregate schedule stays
+            // evenly spaced
+            conn.send_ts.resize(open_loop_slots(params.interval_ns));
+            conn.next_send_ns = static_cast<uint64_t>(params.interval_ns * i / fds.size());
+            conn.rng.seed(i + 1);
+        } else {
+            conn.send_ts.resize(opts.window);
+        }
+        if (opts.udp) {
+            conn.slot_seq.assign(conn.send_ts.size(), -1);
+        }
+        conn.recv_buffer.resize(std::max<size_t>(kWindowRecvBufferSize, payload_size));
+        workers[i % thread_count].conns.push_back(std::move(conn));
+    }
+    for (int t = 0; t < thread_count; ++t) {
+        LoadWorker& worker = workers[t];
+        if (!opts.cpus.empty()) {
+            worker.cpu = opts.cpus[t % opts.cpus.size()];
+        }
+    }
+
+    std::vector<int> saved_flags(fds.size());
+    for (size_t i = 0; i < fds.size(); ++i) {
+        saved_flags[i] = fcntl(fds[i], F_GETFL, 0);
+        if (saved_flags[i] < 0 ||
+            fcntl(fds[i], F_SETFL, saved_flags[i] | O_NONBLOCK) < 0) {
+            perror("fcntl O_NONBLOCK");
+            return false;
+        }
+    }
+
+    std::atomic<bool> start{false};
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+    for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back(run_load_worker, &workers[t], &params, &start);
+    }
+    const uint64_t start_ns = now_ns();
+    params.start_ns = start_ns;
+    start.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const uint64_t wall_ns = now_ns() - start_ns;
+
+    for (size_t i = 0; i < fds.size(); ++i) {
+        fcntl(fds[i], F_SETFL, saved_flags[i]);
+    }
+
+    hist->reset();
+    PathBreakdown paths;
+    bool ok = true;
+    summary->udp = opts.udp;
+    for (LoadWorker& worker : workers) {
+        ok = ok && worker.ok;
+        hist->merge(worker.hist);
+        paths.merge(worker.paths);
+        for (const LoadConn& conn : worker.conns) {
+            summary->lost += conn.lost;
+            summary->reordered += conn.reordered;
+            summary->late += conn.late;
+        }
+    }
+    if (!ok) {
+        fprintf(stderr, "load test failed after %" PRIu64 " replies\n", hist->count());
+        return false;
+    }
+
+    if (!compute_statistics(*hist, payload_size, summary)) {
+        fprintf(stderr, "No RTT data collected for payload_size=%" PRIu32 "\n",
+                payload_size);
+        return false;
+    }
+    paths.summarize(summary);
+    summary->window = opts.window;
+    summary->connections = static_cast<int>(fds.size());
+    summary->threads = thread_count;
+    summary->offered_rps = opts.rate;
+    summary->throughput_rps = (wall_ns > 0) ? (1e9 * hist->count() / wall_ns) : 0.0;
+
+    if (print_result) {
+        print_statistics(*summary);
+    }
+    return true;
+}
+
+// Short-connection mode (--short K): every worker thread repeats
+// socket() + connect(), K ping-pong requests and close(), msg_count times,
+// so the cost of connection setup and teardown is part of what is
+// measured. Each request is recorded as usual; connect latency runs from
+// socket() to connect() returning, and a transaction from socket() to
+// close() returning.
+//
+// The client closes first, so TIME_WAIT piles up on its side and a fast
+// server runs the client out of ephemeral ports within seconds; --linger0
+// closes with an RST instead, which leaves no TIME_WAIT behind.
+struct ShortConnParams {
+    sockaddr_in addr{};
+    int transactions = 0;  // per thread
+    int requests_per_conn = 1;
+    bool linger0 = false;
+    int busy_poll_us = 0;
+};
+
+struct ShortConnWorker {
+    LatencyHistogram hist;
+    LatencyHistogram connect;
+    LatencyHistogram txn;
+    PathBreakdown paths;
+    std::vector<char> request;
+    int cpu = -1;
+    bool ok = true;
+};
+
+static bool run_short_transaction(ShortConnWorker& worker, const ShortConnParams& params,
+                                  std::vector<char>& recv_buffer)
+{
+    const uint64_t start_ns = now_ns();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return false;
+    }
+    if (params.linger0) {
+        const linger lin = {1, 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&params.addr), sizeof(params.addr)) < 0) {
+        fprintf(stderr, "connect failed after %" PRIu64 " connections: %s%s\n",
+                worker.connect.count(), strerror(errno),
+                errno == EADDRNOTAVAIL ? " (out of ephemeral ports, try --linger0)" : "");
+        close(fd);
+        return false;
+    }
+    worker.connect.record(now_ns() - start_ns);
+    if (params.busy_poll_us > 0 && !enable_busy_poll(fd, params.busy_poll_us, true)) {
+        close(fd);
+        return false;
+    }
+
+    auto* header = reinterpret_cast<Msg*>(worker.request.data());
+    for (int i = 0; i < params.requests_per_conn; ++i) {
+        const uint64_t send_ts = now_ns();
+        header->seq = static_cast<uint64_t>(i);
+        header->client_send_ns = send_ts;
+        KernelSocket io{fd};
+        if (!transport_send_all(io, worker.request.data(), worker.request.size()) ||
+            !transport_recv_message(io, recv_buffer)) {
+            fprintf(stderr, "request %d failed: %s\n", i, transport_strerror(errno));
+            close(fd);
+            return false;
+        }
+        const uint64_t now = now_ns();
+        worker.hist.record(now - send_ts);
+
+        Msg reply;
+        std::memcpy(&reply, recv_buffer.data(), sizeof(reply));
+        if (!check_reply(reply, static_cast<uint64_t>(i))) {
+            close(fd);
+            return false;
+        }
+        worker.paths.record(reply, now);
+    }
+
+    close(fd);
+    worker.txn.record(now_ns() - start_ns);
+    return true;
+}
+
+static void run_short_conn_worker(ShortConnWorker* worker, const ShortConnParams* params,
+                                  const std::atomic<bool>* start)
+{
+    if (worker->cpu >= 0) {
+        pin_current_thread(worker->cpu);
+    }
+    std::vector<char> recv_buffer;
+    while (!start->load(std::memory_order_acquire)) {
+    }
+    for (int i = 0; i < params->transactions; ++i) {
+        if (!run_short_transaction(*worker, *params, recv_buffer)) {
+            worker->ok = false;
+            return;
+        }
+    }
+}
+
+static bool run_short_conn_test(const char* server_ip,
+                                int port,
+                                uint32_t payload_size,
+                                int msg_count,
+                                const ClientOptions& opts,
+                                LatencySummary* summary,
+                                LatencyHistogram* hist,
+                                bool print_result = true)
+{
+    if (!validate_payload_args(payload_size, msg_count)) {
+        return false;
+    }
+
+    ShortConnParams params;
+    if (!make_server_addr(server_ip, port, &params.addr)) {
+        return false;
+    }
+    params.transactions = msg_count;
+    params.requests_per_conn = opts.short_requests;
+    params.linger0 = opts.linger0;
+    params.busy_poll_us = opts.busy_poll_us;
+
+    if (print_result) {
+        printf("\nShort connections to %s:%d with payload_size=%" PRIu32
+               ", %d connection(s) per thread with %d request(s) each, threads=%d%s...\n",
+               server_ip, port, payload_size, msg_count, opts.short_requests, opts.threads,
+               opts.linger0 ? ", RST on close" : "");
+    }
+
+    std::vector<char> request(payload_size);
+    auto* header = reinterpret_cast<Msg*>(request.data());
+    msg_init(header, payload_size, MSG_FLAG_SERVER_TS);
+    std::fill(request.begin() + sizeof(Msg), request.end(), 0x42);
+
+    std::vector<ShortConnWorker> workers(opts.threads);
+    for (int t = 0; t < opts.threads; ++t) {
+        workers[t].request = request;
+        if (!opts.cpus.empty()) {
+            workers[t].cpu = opts.cpus[t % opts.cpus.size()];
+        }
+    }
+
+    std::atomic<bool> start{false};
+    std::vector<std::thread> threads;
+    threads.reserve(opts.threads);
+    for (int t = 0; t < opts.threads; ++t) {
+        threads.emplace_back(run_short_conn_worker, &workers[t], &params, &start);
+    }
+    const uint64_t start_ns = now_ns();
+    start.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    const uint64_t wall_ns = now_ns() - start_ns;
+
+    hist->reset();
+    LatencyHistogram connect;
+    LatencyHistogram txn;
+    PathBreakdown paths;
+    bool ok = true;
+    for (ShortConnWorker& worker : workers) {
+        ok = ok && worker.ok;
+        hist->merge(worker.hist);
+        connect.merge(worker.connect);
+        txn.merge(worker.txn);
+        paths.merge(worker.paths);
+    }
+    if (!ok) {
+        fprintf(stderr, "short connection test failed after %" PRIu64 " connections\n",
+                txn.count());
+        return false;
+    }
+
+    if (!compute_statistics(*hist, payload_size, summary)) {
+        fprintf(stderr, "No RTT data collected for payload_size=%" PRIu32 "\n",
+                payload_size);
+        return false;
+    }
+    paths.summarize(summary);
+    summary->threads = opts.threads;
+    summary->requests_per_conn = opts.short_requests;
+    summary->connect_avg_ns = connect.mean();
+    summary->connect_p99_ns = connect.percentile(0.99);
+    summary->txn_avg_ns = txn.mean();
+    summary->txn_p99_ns = txn.percentile(0.99);
+    summary->conns_per_sec = (wall_ns > 0) ? (1e9 * txn.count() / wall_ns) : 0.0;
+    summary->throughput_rps = (wall_ns > 0) ? (1e9 * hist->count() / wall_ns) : 0.0;
+
+    if (print_result) {
+        print_statistics(*summary);
+    }
+    return true;
+}
+
+static bool run_test(const std::vector<int>& fds,
+                     const char* server_ip,
+                     int port,
+                     uint32_t payload_size,
+                     int msg_count,
+                     const ClientOptions& opts,
+                     LatencySummary* summary,
+                     LatencyHistogram* hist,
+                     ShmTransport* shm,
+                     bool print_result = true)
+{
+    if (shm != nullptr) {
+        return run_payload_test(*shm, server_ip, port, payload_size, msg_count,
+                                summary, hist, false, print_result);
+    }
+    if (opts.short_requests > 0) {
+        return run_short_conn_test(server_ip, port, payload_size, msg_count,
+                                   opts, summary, hist, print_result);
+    }
+    if (opts.udp || opts.window > 1 || opts.rate > 0.0 || fds.size() > 1 ||
+        !opts.cpus.empty()) {
+        return run_load_test(fds, server_ip, port, payload_size, msg_count,
+                             opts, summary, hist, print_result);
+    }
+    ClientSocket io(fds[0]);
+    return run_payload_test(io, server_ip, port, payload_size, msg_count,
+                            summary, hist, opts.timestamping, print_result);
+}
+
 static std::string make_csv_basename(const char* basename)
 {
     std::string name = (basename && basename[0] != '\0')
@@ -327,20 +1500,273 @@ static bool ensure_directory_exists(const std::string& path)
     return false;
 }
 
+// --clock-selftest: what a timestamp costs and how far the calibrated TSC
+// wanders from CLOCK_MONOTONIC
+static void run_clock_selftest()
+{
+    printf("Clock source: %s", clock_source_name());
+    if (g_clock.use_tsc) {
+        printf(" (%.4f GHz)", clock_tsc_ghz());
+    }
+    printf("\n");
+
+    constexpr int kCalls = 2000000;
+    const auto cost = [](uint64_t (*read)()) {
+        volatile uint64_t sink = 0;
+        const uint64_t start = clock_monotonic_ns();
+        for (int i = 0; i < kCalls; ++i) {
+            sink = sink + read();
+        }
+        return static_cast<double>(clock_monotonic_ns() - start) / kCalls;
+    };
+    printf("now_ns():                 %.1f ns/call\n", cost(now_ns));
+    printf("CLOCK_MONOTONIC:          %.1f ns/call\n", cost(clock_monotonic_ns));
+    printf("CLOCK_MONOTONIC_RAW:      %.1f ns/call\n", cost([]() -> uint64_t {
+               timespec ts;
+               clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+               return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+           }));
+
+    uint64_t resolution = UINT64_MAX;
+    for (int i = 0; i < 1000; ++i) {
+        const uint64_t a = now_ns();
+        uint64_t b = now_ns();
+        while (b == a) {
+            b = now_ns();
+        }
+        resolution = std::min(resolution, b - a);
+    }
+    printf("now_ns() resolution:      %" PRIu64 " ns\n", resolution);
+
+    // Offset of now_ns() against CLOCK_MONOTONIC, sampled over two seconds
+    constexpr int kSteps = 10;
+    const auto offset = [] {
+        const uint64_t mono = clock_monotonic_ns();
+        return static_cast<int64_t>(now_ns() - mono);
+    };
+    const uint64_t first_ns = clock_monotonic_ns();
+    const int64_t first = offset();
+    int64_t last = first;
+    for (int i = 0; i < kSteps; ++i) {
+        timespec wait = {0, 200000000};
+        nanosleep(&wait, nullptr);
+        last = offset();
+    }
+    const double elapsed_s = (clock_monotonic_ns() - first_ns) / 1e9;
+    printf("offset vs CLOCK_MONOTONIC: %" PRId64 " ns -> %" PRId64 " ns over %.1f s "
+           "(drift %.3f ppm)\n",
+           first, last, elapsed_s, (last - first) / (elapsed_s * 1e3));
+}
+
+static void print_usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [--window N] [--connections C] [--threads T] [--cpus LIST] "
+            "[--rate R [--poisson]] [--udp] [--short K [--linger0]] "
+            "<server_ip> <port> <msg_count> <payload_size|-1> [output_basename]\n"
+            "       %s --shm NAME <msg_count> <payload_size|-1> [output_basename]\n"
+            "  --window N       keep N requests in flight per connection "
+            "(default 1, ping-pong)\n"
+            "  --connections C  open C connections; msg_count is per connection\n"
+            "  --threads T      spread connections over T worker threads\n"
+            "  --cpus LIST      pin worker threads to CPUs, e.g. 0-3 or 1,3,5\n"
+            "  --rate R         open loop: offer R requests/sec in total, latency\n"
+            "                   measured from the scheduled send time\n"
+            "  --poisson        with --rate, exponential inter-arrival times\n"
+            "  --udp            echo UDP datagrams; replies are matched by seq, and\n"
+            "                   loss, reordering and late replies are reported\n"
+            "  --short K        connect, send K requests, close, repeat: msg_count\n"
+            "                   connections per thread (--threads), reports connect\n"
+            "                   and transaction latency and conns/sec\n"
+            "  --linger0        with --short, close with RST to avoid TIME_WAIT\n"
+            "  --busy-poll[=US] spin on non-blocking sockets with SO_BUSY_POLL=US (default\n"
+            "                   50), SO_PREFER_BUSY_POLL, epoll busy polling, TCP_NODELAY\n"
+            "                   and TCP_QUICKACK\n"
+            "  --perf           count cycles, instructions, cache/branch/L1d misses and\n"
+            "                   context switches over each measured run (perf_event_open)\n"
+            "  --timestamping   ping-pong only: also report wire RTT from SO_TIMESTAMPING\n"
+            "                   (hardware stamps when the NIC has them enabled)\n"
+            "  --no-coalesce    load engine: one sendmsg per TCP frame (with MSG_MORE while\n"
+            "                   more are due) instead of one for every frame that is due\n"
+            "  --shm NAME       ping-pong over a shared-memory ring to shm_echo NAME:\n"
+            "                   no network, so the RTT is the client/responder floor\n"
+            "  --clock-selftest report timestamp overhead and TSC drift, then exit\n"
+            "Set ECHO_CLOCK=monotonic to keep now_ns() off the TSC.\n",
+            prog, prog);
+}
+
+// Options must precede the positional arguments ("+"), since a payload
+// size of -1 would otherwise be taken for an option
+static bool parse_options(int argc, char* argv[], ClientOptions* opts)
+{
+    static const option long_options[] = {
+        {"window", required_argument, nullptr, 'w'},
+        {"connections", required_argument, nullptr, 'C'},
+        {"threads", required_argument, nullptr, 'T'},
+        {"cpus", required_argument, nullptr, 'c'},
+        {"rate", required_argument, nullptr, 'r'},
+        {"poisson", no_argument, nullptr, 'P'},
+        {"clock-selftest", no_argument, nullptr, 'S'},
+        {"timestamping", no_argument, nullptr, 't'},
+        {"udp", no_argument, nullptr, 'u'},
+        {"short", required_argument, nullptr, 'K'},
+        {"linger0", no_argument, nullptr, 'L'},
+        {"perf", no_argument, nullptr, 'p'},
+        {"busy-poll", optional_argument, nullptr, 'b'},
+        {"shm", required_argument, nullptr, 'm'},
+        {"no-coalesce", no_argument, nullptr, 'n'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "+w:C:T:c:r:PStuK:Lpb::m:nh", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'w': {
+            char* end = nullptr;
+            long value = strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0 || value > INT_MAX) {
+                fprintf(stderr, "window must be a positive integer\n");
+                return false;
+            }
+            opts->window = static_cast<int>(value);
+            break;
+        }
+        case 'C':
+        case 'T': {
+            char* end = nullptr;
+            long value = strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0 || value > 65535) {
+                fprintf(stderr, "%s must be a positive integer\n",
+                        c == 'C' ? "connections" : "threads");
+                return false;
+            }
+            (c == 'C' ? opts->connections : opts->threads) = static_cast<int>(value);
+            break;
+        }
+        case 'c': {
+            opts->cpus.resize(CPU_SETSIZE);
+            int count = parse_cpu_list(optarg, opts->cpus.data(), CPU_SETSIZE);
+            if (count < 0) {
+                fprintf(stderr, "invalid cpu list: %s\n", optarg);
+                return false;
+            }
+            opts->cpus.resize(count);
+            break;
+        }
+        case 'r': {
+            char* end = nullptr;
+            double value = strtod(optarg, &end);
+            if (*end != '\0' || !(value > 0.0)) {
+                fprintf(stderr, "rate must be a positive number\n");
+                return false;
+            }
+            opts->rate = value;
+            break;
+        }
+        case 'P':
+            opts->poisson = true;
+            break;
+        case 'S':
+            opts->clock_selftest = true;
+            break;
+        case 't':
+            opts->timestamping = true;
+            break;
+        case 'u':
+            opts->udp = true;
+            break;
+        case 'K': {
+            char* end = nullptr;
+            long value = strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0 || value > INT_MAX) {
+                fprintf(stderr, "short must be a positive integer\n");
+                return false;
+            }
+            opts->short_requests = static_cast<int>(value);
+            break;
+        }
+        case 'L':
+            opts->linger0 = true;
+            break;
+        case 'p':
+            opts->perf = true;
+            break;
+        case 'b': {
+            long value = BUSY_POLL_DEFAULT_US;
+            if (optarg != nullptr) {
+                char* end = nullptr;
+                value = strtol(optarg, &end, 10);
+                if (*end != '\0' || value <= 0 || value > INT_MAX) {
+                    fprintf(stderr, "busy-poll must be a positive number of microseconds\n");
+                    return false;
+                }
+            }
+            opts->busy_poll_us = static_cast<int>(value);
+            break;
+        }
+        case 'm':
+            opts->shm_name = optarg;
+            break;
+        case 'n':
+            opts->coalesce = false;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (opts->poisson && opts->rate <= 0.0) {
+        fprintf(stderr, "--poisson requires --rate\n");
+        return false;
+    }
+    if (opts->timestamping && (opts->udp || opts->window > 1 || opts->connections > 1 ||
+                               opts->rate > 0.0 || !opts->cpus.empty())) {
+        fprintf(stderr, "--timestamping works in ping-pong mode only\n");
+        return false;
+    }
+    if (opts->linger0 && opts->short_requests == 0) {
+        fprintf(stderr, "--linger0 requires --short\n");
+        return false;
+    }
+    if (opts->short_requests > 0 && (opts->udp || opts->timestamping || opts->window > 1 ||
+                                     opts->connections > 1 || opts->rate > 0.0)) {
+        fprintf(stderr, "--short opens its own connections; use --threads to scale it\n");
+        return false;
+    }
+    if (opts->shm_name != nullptr &&
+        (opts->udp || opts->timestamping || opts->window > 1 || opts->connections > 1 ||
+         opts->rate > 0.0 || !opts->cpus.empty() || opts->short_requests > 0 ||
+         opts->busy_poll_us > 0)) {
+        fprintf(stderr, "--shm works in ping-pong mode only\n");
+        return false;
+    }
+    return true;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 5) {
-        fprintf(stderr,
-                "Usage: %s <server_ip> <port> <msg_count> <payload_size|-1> "
-                "[output_basename]\n",
-                argv[0]);
+    ClientOptions opts;
+    if (!parse_options(argc, argv, &opts)) {
+        print_usage(argv[0]);
         return 1;
     }
-
-    const char *server_ip = argv[1];
-    int port = atoi(argv[2]);
+    clock_init();
+    if (opts.clock_selftest) {
+        run_clock_selftest();
+        return 0;
+    }
+    // Positional arguments follow the options; --shm names its peer itself
+    const int address_args = opts.shm_name != nullptr ? 0 : 2;
+    if (argc - optind < address_args + 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char *server_ip = address_args > 0 ? argv[optind] : opts.shm_name;
+    int port = address_args > 0 ? atoi(argv[optind + 1]) : 0;
+    char** args = argv + optind + address_args;
+    const int nargs = argc - optind - address_args;
 
     char* endptr = nullptr;
-    long msg_count_long = strtol(argv[3], &endptr, 10);
+    long msg_count_long = strtol(args[0], &endptr, 10);
     if (*endptr != '\0' || msg_count_long <= 0 || msg_count_long > INT_MAX) {
         fprintf(stderr, "msg_count must be a positive integer\n");
         return 1;
@@ -348,12 +1774,12 @@ int main(int argc, char *argv[]) {
     int msg_count = static_cast<int>(msg_count_long);
 
     char* payload_end = nullptr;
-    long payload_arg = strtol(argv[4], &payload_end, 10);
+    long payload_arg = strtol(args[1], &payload_end, 10);
     if (*payload_end != '\0') {
         fprintf(stderr, "payload_size must be an integer or -1\n");
         return 1;
     }
-    const char* output_basename = (argc >= 6) ? argv[5] : nullptr;
+    const char* output_basename = (nargs >= 3) ? args[2] : nullptr;
 
     bool sweep_payloads = (payload_arg == -1);
     if (sweep_payloads && (!output_basename || output_basename[0] == '\0')) {
@@ -391,11 +1817,52 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     summary_file << "payload_size,avg_latency_ns,min_latency_ns,p50_ns,"
-                    "p90_ns,p99_ns,p99.9_ns,max_latency_ns,throughput_rps\n";
+                    "p90_ns,p99_ns,p99.9_ns,max_latency_ns,throughput_rps,window,"
+                    "connections,threads,offered_rps,request_path_ns,server_ns,"
+                    "response_path_ns,server_p99_ns,wire_avg_ns,wire_p50_ns,"
+                    "wire_p99_ns,lost,reordered,late,requests_per_conn,"
+                    "connect_avg_ns,connect_p99_ns,txn_avg_ns,txn_p99_ns,"
+                    "conns_per_sec,ipc,cycles_per_req,instructions_per_req,"
+                    "cache_misses_per_req,branch_misses_per_req,"
+                    "l1d_misses_per_req,context_switches_per_req,busy_poll_us,"
+                    "coalesce\n";
 
-    int shared_fd = connect_tcp(server_ip, port);
-    if (shared_fd < 0) {
-        return 1;
+    // Opened before any worker thread exists, so the counters inherit into
+    // every thread the runs create
+    PerfCounters perf;
+    if (opts.perf && perf.open(true) == 0) {
+        fprintf(stderr, "perf_event_open failed: %s; continuing without counters\n",
+                strerror(errno));
+    }
+
+    // --shm replaces the connection with a channel to shm_echo
+    ShmChannel* channel = nullptr;
+    ShmTransport shm;
+    if (opts.shm_name != nullptr) {
+        channel = shm_channel_map(opts.shm_name, false);
+        if (channel == nullptr || !shm_channel_connect(channel)) {
+            return 1;
+        }
+        shm = ShmTransport(channel, false);
+    }
+
+    // Connections stay open across all payload sizes; --short makes its own
+    const int persistent = (opts.short_requests > 0 || channel != nullptr) ? 0 : opts.connections;
+    std::vector<int> fds;
+    fds.reserve(persistent);
+    for (int i = 0; i < persistent; ++i) {
+        int fd = connect_server(server_ip, port, opts.udp);
+        if (fd >= 0 && opts.busy_poll_us > 0 && !enable_busy_poll(fd, opts.busy_poll_us, !opts.udp)) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            for (int open_fd : fds) {
+                close(open_fd);
+            }
+            return 1;
+        }
+        fds.push_back(fd);
     }
 
     bool overall_success = true;
@@ -404,31 +1871,46 @@ int main(int argc, char *argv[]) {
 
         if (idx == 0) {
             LatencySummary warmup_summary{};
-            if (!run_payload_test_on_fd(shared_fd,
-                                        server_ip,
-                                        port,
-                                        payload_size,
-                                        msg_count,
-                                        &warmup_summary,
-                                        nullptr,
-                                        false)) {
+            LatencyHistogram warmup_hist;
+            if (!run_test(fds,
+                          server_ip,
+                          port,
+                          payload_size,
+                          msg_count,
+                          opts,
+                          &warmup_summary,
+                          &warmup_hist,
+                          channel != nullptr ? &shm : nullptr,
+                          false)) {
                 overall_success = false;
             }
         }
 
+        // Only the measured run is counted; the warmup stays out of it
         LatencySummary summary{};
-        std::vector<uint64_t> samples;
-        bool ok = run_payload_test_on_fd(shared_fd,
-                                         server_ip,
-                                         port,
-                                         payload_size,
-                                         msg_count,
-                                         &summary,
-                                         sweep_payloads ? &samples : nullptr);
+        LatencyHistogram hist;
+        perf.start();
+        bool ok = run_test(fds,
+                           server_ip,
+                           port,
+                           payload_size,
+                           msg_count,
+                           opts,
+                           &summary,
+                           &hist,
+                           channel != nullptr ? &shm : nullptr);
+        perf.stop();
         if (!ok) {
             overall_success = false;
             continue;
         }
+        if (perf.is_open()) {
+            summary.perf = perf.read();
+            char line[512];
+            format_perf_sample(line, sizeof(line), summary.perf,
+                               static_cast<uint64_t>(summary.sample_count));
+            printf("Client counters (%s): %s\n", perf.scope(), line);
+        }
 
         if (summary_file.is_open()) {
             summary_file << summary.payload_size << ','
@@ -439,7 +1921,33 @@ int main(int argc, char *argv[]) {
                          << summary.p99_ns << ','
                          << summary.p999_ns << ','
                          << summary.max_ns << ','
-                         << summary.throughput_rps << '\n';
+                         << summary.throughput_rps << ','
+                         << summary.window << ','
+                         << summary.connections << ','
+                         << summary.threads << ','
+                         << summary.offered_rps << ','
+                         << summary.request_path_ns << ','
+                         << summary.server_ns << ','
+                         << summary.response_path_ns << ','
+                         << summary.server_p99_ns << ','
+                         << summary.wire_avg_ns << ','
+                         << summary.wire_p50_ns << ','
+                         << summary.wire_p99_ns << ','
+                         << summary.lost << ','
+                         << summary.reordered << ','
+                         << summary.late << ','
+                         << summary.requests_per_conn << ','
+                         << summary.connect_avg_ns << ','
+                         << summary.connect_p99_ns << ','
+                         << summary.txn_avg_ns << ','
+                         << summary.txn_p99_ns << ','
+                         << summary.conns_per_sec << ','
+                         << summary.perf.ipc();
+            for (int e = 0; e < PERF_EVENT_COUNT; ++e) {
+                summary_file << ',' << summary.perf.per(static_cast<PerfEvent>(e),
+                                                        summary.sample_count);
+            }
+            summary_file << ',' << opts.busy_poll_us << ',' << opts.coalesce << '\n';
 
             const std::string detail_path =
                 output_dir + "/" + output_base + "_" + std::to_string(payload_size) + ".csv";
@@ -449,15 +1957,21 @@ int main(int argc, char *argv[]) {
                 overall_success = false;
                 continue;
             }
-            detail_file << "latency_ns\n";
-            for (uint64_t value : samples) {
-                detail_file << value << '\n';
-            }
+            // One row per histogram bucket, so the file size does not grow
+            // with msg_count
+            detail_file << "latency_ns,count\n";
+            hist.for_each_bucket([&](uint64_t value, uint64_t count) {
+                detail_file << value << ',' << count << '\n';
+            });
         }
     }
 
-    if (shared_fd >= 0) {
-        close(shared_fd);
+    for (int fd : fds) {
+        close(fd);
+    }
+    if (channel != nullptr) {
+        shm_channel_close(channel);
+        shm_channel_unmap(channel);
     }
 
     if (summary_file.is_open()) {
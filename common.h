@@ -6,19 +6,341 @@
 #include <inttypes.h>
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-static inline uint64_t now_ns(void) {
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#define CLOCK_TSC_SHIFT 32
+#define CLOCK_CALIBRATE_NS 50000000ull
+
+// now_ns() source. With an invariant TSC, clock_init() calibrates the
+// counter against CLOCK_MONOTONIC and now_ns() becomes rdtscp plus a
+// multiply; otherwise (or with ECHO_CLOCK=monotonic in the environment)
+// it stays on CLOCK_MONOTONIC, which the vDSO serves without a syscall.
+// Either way the values are in the CLOCK_MONOTONIC domain, so a client
+// and a server on the same host can compare timestamps.
+// Call clock_init() once at startup, before any threads are created.
+struct ClockState {
+    int use_tsc;
+    uint64_t tsc_base;
+    uint64_t ns_base;
+    uint64_t mult;  // ns = ticks * mult >> CLOCK_TSC_SHIFT
+};
+static struct ClockState g_clock;
+
+static inline uint64_t clock_monotonic_ns(void) {
     struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
     return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
+#ifdef HAVE_TSC
+static inline uint64_t read_tsc(void) {
+    unsigned int aux;
+    return __rdtscp(&aux);
+}
+
+// CPUID.80000007H:EDX[8]: the TSC ticks at a constant rate in every P/C-state
+static inline int tsc_is_invariant(void) {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+    return (edx >> 8) & 1;
+}
+#else
+static inline uint64_t read_tsc(void) { return 0; }
+static inline int tsc_is_invariant(void) { return 0; }
+#endif
+
+static inline uint64_t now_ns(void) {
+    if (g_clock.use_tsc) {
+        uint64_t ticks = read_tsc() - g_clock.tsc_base;
+        return g_clock.ns_base +
+               (uint64_t)(((unsigned __int128)ticks * g_clock.mult) >> CLOCK_TSC_SHIFT);
+    }
+    return clock_monotonic_ns();
+}
+
+// A (tsc, monotonic ns) pair read as close together as possible: the
+// clock read is bracketed by two TSC reads and the tightest try wins
+static inline void clock_sample(uint64_t *tsc, uint64_t *ns) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 16; ++i) {
+        uint64_t t0 = read_tsc();
+        uint64_t n = clock_monotonic_ns();
+        uint64_t t1 = read_tsc();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            *tsc = t0 + (t1 - t0) / 2;
+            *ns = n;
+        }
+    }
+}
+
+// Returns 1 if now_ns() now reads the TSC, 0 if it uses CLOCK_MONOTONIC
+static inline int clock_init(void) {
+    g_clock.use_tsc = 0;
+    const char *env = getenv("ECHO_CLOCK");
+    if ((env != NULL && strcmp(env, "monotonic") == 0) || !tsc_is_invariant()) {
+        return 0;
+    }
+
+    uint64_t tsc0, ns0, tsc1, ns1;
+    clock_sample(&tsc0, &ns0);
+    struct timespec wait = {0, (long)CLOCK_CALIBRATE_NS};
+    while (nanosleep(&wait, &wait) != 0) {
+    }
+    clock_sample(&tsc1, &ns1);
+    if (tsc1 <= tsc0 || ns1 <= ns0) {
+        return 0;
+    }
+
+    // Refuse implausible rates (broken virtual TSC) rather than mis-time
+    double ns_per_tick = (double)(ns1 - ns0) / (double)(tsc1 - tsc0);
+    if (ns_per_tick < 0.1 || ns_per_tick > 10.0) {
+        return 0;
+    }
+    g_clock.mult = (uint64_t)(ns_per_tick * (double)(1ull << CLOCK_TSC_SHIFT) + 0.5);
+    g_clock.tsc_base = tsc1;
+    g_clock.ns_base = ns1;
+    g_clock.use_tsc = 1;
+    return 1;
+}
+
+static inline double clock_tsc_ghz(void) {
+    if (!g_clock.use_tsc) {
+        return 0.0;
+    }
+    return (double)(1ull << CLOCK_TSC_SHIFT) / (double)g_clock.mult;
+}
+
+static inline const char *clock_source_name(void) {
+    return g_clock.use_tsc ? "tsc" : "clock_monotonic";
+}
+
+#define MSG_MAGIC   0xEC40
+#define MSG_VERSION 1
+
+// Set by the client to ask the server to fill server_recv_ns/server_send_ns
+#define MSG_FLAG_SERVER_TS 0x01
+
+// Wire header at the start of every frame; servers echo it back as is,
+// apart from the server timestamps. payload_size stays first so framing
+// does not depend on the version.
 #pragma pack(push, 1)
 struct Msg {
-    uint32_t payload_size;
+    uint32_t payload_size;    // whole frame, header included
+    uint16_t magic;           // MSG_MAGIC
+    uint8_t version;          // MSG_VERSION
+    uint8_t flags;            // MSG_FLAG_*
+    uint64_t seq;             // per-connection request number
+    uint64_t client_send_ns;  // client clock
+    uint64_t server_recv_ns;  // server clock, when MSG_FLAG_SERVER_TS is set
+    uint64_t server_send_ns;
 };
 #pragma pack(pop)
 
+static inline void msg_init(struct Msg *msg, uint32_t payload_size, uint8_t flags)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->payload_size = payload_size;
+    msg->magic = MSG_MAGIC;
+    msg->version = MSG_VERSION;
+    msg->flags = flags;
+}
+
+static inline int msg_wants_server_ts(const struct Msg *msg)
+{
+    return msg->magic == MSG_MAGIC && msg->version == MSG_VERSION &&
+           (msg->flags & MSG_FLAG_SERVER_TS);
+}
+
+// Stamp one header in place; hdr need not be aligned
+static inline void msg_stamp_header(char *hdr, uint64_t recv_ns, uint64_t send_ns)
+{
+    struct Msg msg;
+    memcpy(&msg, hdr, sizeof(msg));
+    if (msg_wants_server_ts(&msg)) {
+        msg.server_recv_ns = recv_ns;
+        msg.server_send_ns = send_ns;
+        memcpy(hdr, &msg, sizeof(msg));
+    }
+}
+
+// Stamp every frame in buf[0, len), which must hold complete frames only
+// (the byte count returned by scan_frames). recv_ns is when the batch was
+// read from the socket, send_ns when it is handed back for sending.
+static inline void msg_stamp_frames(char *buf, size_t len,
+                                    uint64_t recv_ns, uint64_t send_ns)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        struct Msg header;
+        memcpy(&header, buf + pos, sizeof(header));
+        msg_stamp_header(buf + pos, recv_ns, send_ns);
+        pos += header.payload_size;
+    }
+}
+
+// Walk the complete frames at the start of buf[0, len).
+// Returns the number of bytes they cover and stores their count in *frames.
+// *need is set to the total size of the first incomplete frame once its
+// header has arrived (0 otherwise), so callers can grow their buffer.
+// Returns -1 if a header carries payload_size < sizeof(Msg).
+static inline long scan_frames(const char *buf, size_t len,
+                               size_t *frames, size_t *need)
+{
+    size_t pos = 0;
+    size_t count = 0;
+    *need = 0;
+    while (len - pos >= sizeof(struct Msg)) {
+        struct Msg header;
+        memcpy(&header, buf + pos, sizeof(header));
+        if (header.payload_size < sizeof(struct Msg)) {
+            return -1;
+        }
+        if (len - pos < header.payload_size) {
+            *need = header.payload_size;
+            break;
+        }
+        pos += header.payload_size;
+        count++;
+    }
+    *frames = count;
+    return (long)pos;
+}
+
+// Parse a CPU list in the lcore_list format of config.ini ("0-3,5,7").
+// Returns the number of CPUs stored in cpus[], or -1 on a malformed list.
+static inline int parse_cpu_list(const char *text, int *cpus, int max_cpus)
+{
+    int count = 0;
+    const char *p = text;
+    while (*p != '\0') {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) {
+            return -1;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+            p = end;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (count == max_cpus) {
+                return -1;
+            }
+            cpus[count++] = (int)cpu;
+        }
+        if (*p == ',') {
+            ++p;
+        } else if (*p != '\0') {
+            return -1;
+        }
+    }
+    return count > 0 ? count : -1;
+}
+
+static inline int pin_current_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        fprintf(stderr, "pthread_setaffinity_np(cpu=%d): %s\n",
+                cpu, strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Busy-poll mode (--busy-poll[=US] on the client and the kernel server).
+// An empty receive makes the kernel poll the NIC queue for up to US
+// microseconds before sleeping until the next interrupt (SO_BUSY_POLL;
+// values above net.core.busy_read need CAP_NET_ADMIN), and
+// SO_PREFER_BUSY_POLL (5.11+) keeps interrupts off the queue while the
+// application polls it. The callers also spin on non-blocking sockets
+// instead of sleeping, which is what F-Stack does.
+#define BUSY_POLL_DEFAULT_US 50
+#define BUSY_POLL_BUDGET 64
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+// Mirrors struct epoll_params from linux/eventpoll.h (6.9+), which older
+// headers lack; under its own name so newer headers do not clash
+struct busy_poll_epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t pad;
+};
+#define BUSY_POLL_EPIOCSPARAMS _IOW(0x8A, 0x01, struct busy_poll_epoll_params)
+
+// Nagle off for an echo TCP socket: a batch of pipelined frames usually
+// ends in a tail shorter than one MSS, which Nagle would hold until the
+// peer's delayed ACK (~40 ms on Linux). Returns setsockopt()'s result.
+static inline int socket_nodelay(int fd)
+{
+    const int one = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Socket options for busy-poll mode; TCP sockets also get TCP_NODELAY and
+// TCP_QUICKACK. Best effort: returns how many options the kernel refused,
+// so callers can warn once.
+static inline int socket_busy_poll(int fd, int usecs, int is_tcp)
+{
+    const int one = 1;
+    const int budget = BUSY_POLL_BUDGET;
+    int failed = 0;
+    failed += setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0;
+    failed += setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0;
+    failed += setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0;
+    if (is_tcp) {
+        failed += setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0;
+        failed += setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) < 0;
+    }
+    return failed;
+}
+
+// Per-epoll-instance busy polling (6.9+), so epoll_wait polls the queues
+// of the sockets it watches. Returns -1 with errno set (ENOTTY on older
+// kernels) on failure.
+static inline int epoll_busy_poll(int epfd, int usecs)
+{
+    struct busy_poll_epoll_params params;
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = (uint32_t)usecs;
+    params.busy_poll_budget = BUSY_POLL_BUDGET;
+    params.prefer_busy_poll = 1;
+    return ioctl(epfd, BUSY_POLL_EPIOCSPARAMS, &params);
+}
+
 // static inline size_t msg_payload_length(uint32_t payload_size) {
 //     if (payload_size < sizeof(Msg)) {
 //         return 0;
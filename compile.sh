@@ -1,4 +1,4 @@
-gcc -O2 -Wall -I/home/alan/_src/f-stack/lib -I/home/alan/_src/f-stack/dpdk/build/include \
+gcc -O2 -Wall ${EXTRA_CFLAGS} -I/home/alan/_src/f-stack/lib -I/home/alan/_src/f-stack/dpdk/build/include \
      -o server_fstack server_fstack.cpp \
      -L/home/alan/_src/f-stack/lib  -L/home/alan/_src/f-stack/dpdk/build/lib \
      -L/home/alan/_src/f-stack/dpdk/build/drivers -lfstack \
@@ -6,3 +6,12 @@ gcc -O2 -Wall -I/home/alan/_src/f-stack/lib -I/home/alan/_src/f-stack/dpdk/build
      -lrte_eal -lrte_ethdev -lrte_mbuf -lrte_mempool -lrte_ring \
      -lrte_kvargs -lrte_net -lrte_log -lrte_timer -lrte_net_bond \
      -lcrypto -lpthread -ldl -lm
+
+# raw DPDK UDP echo, built against the same DPDK tree
+g++ -O2 -Wall ${EXTRA_CFLAGS} -I/home/alan/_src/f-stack/dpdk/build/include \
+     -o server_dpdk server_dpdk.cpp \
+     -L/home/alan/_src/f-stack/dpdk/build/lib \
+     -Wl,--no-as-needed \
+     -lrte_eal -lrte_ethdev -lrte_mbuf -lrte_mempool -lrte_ring \
+     -lrte_kvargs -lrte_net -lrte_log -lrte_telemetry -lrte_net_tap -lrte_net_af_packet \
+     -lpthread -ldl -lm -lnuma
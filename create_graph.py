@@ -10,6 +10,27 @@ from matplotlib.ticker import FuncFormatter
 def us_to_ms_formatter(x, pos):
     return f'{x/1000:.0f}'
 
+def weighted_quantile(values, counts, q):
+    # values are sorted histogram buckets, counts their sample counts
+    cum = np.cumsum(counts)
+    rank = q * (cum[-1] - 1) + 1
+    return values[min(np.searchsorted(cum, rank), len(values) - 1)]
+
+def weighted_box_stats(values, counts, whis=1.5):
+    # Same statistics plt.boxplot() derives from raw samples, computed from a
+    # latency histogram without expanding it
+    q1 = weighted_quantile(values, counts, 0.25)
+    med = weighted_quantile(values, counts, 0.5)
+    q3 = weighted_quantile(values, counts, 0.75)
+    iqr = q3 - q1
+    inside = values[(values >= q1 - whis * iqr) & (values <= q3 + whis * iqr)]
+    return {
+        'med': med, 'q1': q1, 'q3': q3,
+        'whislo': inside.min() if len(inside) else q1,
+        'whishi': inside.max() if len(inside) else q3,
+        'fliers': values[(values < q1 - whis * iqr) | (values > q3 + whis * iqr)],
+    }
+
 def set_auto_log_scale(ax, data_list, margin_factor=0.1):
     all_data = np.concatenate([d for d in data_list if len(d) > 0])
     
@@ -144,6 +165,7 @@ def create_performance_charts(report_name: str):
     # Subplot 3
     ax3 = axes[1, 0]
     latency_data = []
+    box_stats = []
 
     for size in packet_sizes:
         detail_path = output_dir / f"{report_name}_{size}.csv"
@@ -156,10 +178,19 @@ def create_performance_charts(report_name: str):
             latencies = detail_df["latency_ns"]
         else:
             latencies = detail_df.iloc[:, 0]
-        latency_data.append((latencies / 1000.0).to_numpy())  # us
+        # The client writes histogram buckets (latency_ns,count); older
+        # output has one raw sample per row
+        if "count" in detail_df.columns:
+            counts = detail_df["count"].to_numpy()
+        else:
+            counts = np.ones(len(latencies), dtype=np.int64)
+        order = np.argsort(latencies.to_numpy())
+        values = (latencies.to_numpy()[order] / 1000.0)  # us
+        latency_data.append(values)
+        box_stats.append(weighted_box_stats(values, counts[order]))
 
-    bp = ax3.boxplot(latency_data, positions=range(len(packet_sizes)), 
-                    widths=0.6, patch_artist=True)
+    bp = ax3.bxp(box_stats, positions=range(len(packet_sizes)),
+                 widths=0.6, patch_artist=True)
 
     for box in bp['boxes']:
         box.set(facecolor='lightblue', alpha=0.7)
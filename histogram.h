@@ -0,0 +1,168 @@
+// histogram.h
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Log-linear latency histogram in the style of HdrHistogram. Values below
+// 2^precision_bits get a bucket each; above that every power-of-two range
+// is split into 2^(precision_bits - 1) equal buckets, so any recorded
+// value is known to within 1 / 2^(precision_bits - 1) of itself (7 bits:
+// under 1.6%). Memory is fixed at about (65 - precision_bits) *
+// 2^(precision_bits - 1) counters whatever the sample count, recording is
+// O(1), and histograms with equal precision merge by adding counters, so
+// each thread keeps its own and the results are combined at the end.
+//
+// min, max, mean and variance are tracked exactly alongside the buckets.
+class LatencyHistogram {
+public:
+    explicit LatencyHistogram(int precision_bits = 7)
+        : bits_(precision_bits < 2 ? 2 : (precision_bits > 16 ? 16 : precision_bits)),
+          half_(uint64_t{1} << (bits_ - 1)),
+          counts_(bucket_index(UINT64_MAX) + 1, 0) {}
+
+    void record(uint64_t value)
+    {
+        counts_[bucket_index(value)]++;
+        if (count_ == 0 || value < min_) {
+            min_ = value;
+        }
+        if (value > max_) {
+            max_ = value;
+        }
+        count_++;
+        sum_ += value;
+        sum_sq_ += static_cast<long double>(value) * value;
+    }
+
+    // Returns false (and leaves *this untouched) if the precisions differ
+    bool merge(const LatencyHistogram& other)
+    {
+        if (other.bits_ != bits_) {
+            return false;
+        }
+        if (other.count_ == 0) {
+            return true;
+        }
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        if (count_ == 0 || other.min_ < min_) {
+            min_ = other.min_;
+        }
+        if (other.max_ > max_) {
+            max_ = other.max_;
+        }
+        count_ += other.count_;
+        sum_ += other.sum_;
+        sum_sq_ += other.sum_sq_;
+        return true;
+    }
+
+    void reset()
+    {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        count_ = 0;
+        min_ = 0;
+        max_ = 0;
+        sum_ = 0;
+        sum_sq_ = 0;
+    }
+
+    // Value at the given rank ratio (0.5 = median), using the same rank
+    // rule as a sorted array indexed at llround(ratio * (count - 1)).
+    // Reported as the middle of the bucket, clamped to [min, max].
+    uint64_t percentile(double ratio) const
+    {
+        if (count_ == 0) {
+            return 0;
+        }
+        if (ratio <= 0.0) {
+            return min_;
+        }
+        if (ratio >= 1.0) {
+            return max_;
+        }
+        const uint64_t rank = static_cast<uint64_t>(std::llround(ratio * (count_ - 1))) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return clamp(bucket_mid(i));
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t min() const { return min_; }
+    uint64_t max() const { return max_; }
+    int precision_bits() const { return bits_; }
+
+    double mean() const
+    {
+        return count_ ? static_cast<double>(static_cast<long double>(sum_) / count_) : 0.0;
+    }
+
+    double variance() const
+    {
+        if (count_ == 0) {
+            return 0.0;
+        }
+        const long double mean = static_cast<long double>(sum_) / count_;
+        const long double var = sum_sq_ / count_ - mean * mean;
+        return var > 0 ? static_cast<double>(var) : 0.0;
+    }
+
+    // Calls fn(value, count) for every non-empty bucket in ascending order,
+    // with value as reported by percentile()
+    template <typename Fn>
+    void for_each_bucket(Fn fn) const
+    {
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            if (counts_[i] != 0) {
+                fn(clamp(bucket_mid(i)), counts_[i]);
+            }
+        }
+    }
+
+private:
+    // Values with their top set bit at position m >= bits_ are shifted right
+    // until bits_ significant bits remain; the shift picks the bucket group
+    size_t bucket_index(uint64_t value) const
+    {
+        const int msb = 63 - __builtin_clzll(value | 1);
+        const int shift = msb < bits_ ? 0 : msb - bits_ + 1;
+        return static_cast<size_t>(shift) * half_ + (value >> shift);
+    }
+
+    uint64_t bucket_mid(size_t index) const
+    {
+        if (index < 2 * half_) {
+            return index;
+        }
+        const uint64_t shift = index / half_ - 1;
+        const uint64_t low = (index - shift * half_) << shift;
+        return low + ((uint64_t{1} << shift) >> 1);
+    }
+
+    uint64_t clamp(uint64_t value) const
+    {
+        return value < min_ ? min_ : (value > max_ ? max_ : value);
+    }
+
+    int bits_;
+    uint64_t half_;
+    std::vector<uint64_t> counts_;
+    uint64_t count_ = 0;
+    uint64_t min_ = 0;
+    uint64_t max_ = 0;
+    uint64_t sum_ = 0;
+    long double sum_sq_ = 0;
+};
+
+#endif // HISTOGRAM_H
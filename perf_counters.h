@@ -0,0 +1,243 @@
+// perf_counters.h
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware and software counters of one benchmark phase, read through
+// perf_event_open(2). Each event is opened on its own rather than as a
+// group: a group is all-or-nothing, while VMs and some CPUs lack single
+// events (L1 misses especially), and inherited counters cannot be read as
+// a group anyway. Events are multiplexed when there are more than the PMU
+// has slots, so every value is scaled by enabled/running time.
+enum PerfEvent {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,   // last-level cache
+    PERF_BRANCH_MISSES,
+    PERF_L1D_MISSES,     // L1 data cache read misses
+    PERF_CONTEXT_SWITCHES,
+    PERF_EVENT_COUNT
+};
+
+static const char* const kPerfEventNames[PERF_EVENT_COUNT] = {
+    "cycles", "instructions", "cache_misses", "branch_misses", "l1d_misses",
+    "context_switches",
+};
+
+struct PerfSample {
+    uint64_t values[PERF_EVENT_COUNT] = {};
+    bool valid[PERF_EVENT_COUNT] = {};  // event opened and scheduled at least once
+
+    bool any() const
+    {
+        for (bool v : valid) {
+            if (v) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    double ipc() const
+    {
+        return (valid[PERF_CYCLES] && valid[PERF_INSTRUCTIONS] && values[PERF_CYCLES] != 0)
+                   ? static_cast<double>(values[PERF_INSTRUCTIONS]) / values[PERF_CYCLES]
+                   : 0.0;
+    }
+
+    double per(PerfEvent event, uint64_t requests) const
+    {
+        return (valid[event] && requests != 0)
+                   ? static_cast<double>(values[event]) / requests
+                   : 0.0;
+    }
+};
+
+class PerfCounters {
+public:
+    PerfCounters() { std::fill_n(fds_, PERF_EVENT_COUNT, -1); }
+    ~PerfCounters() { close(); }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Counts the calling thread, stopped until start(). With inherit, also
+    // every thread it creates afterwards: reads on the parent cover those
+    // children too, live or exited. Kernel-side counts are
+    // included when perf_event_paranoid (or CAP_PERFMON) allows, user-only
+    // otherwise. Returns the number of events opened.
+    int open(bool inherit)
+    {
+        close();
+        std::memset(base_, 0, sizeof(base_));
+        int opened = 0;
+        kernel_ = true;
+        for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+            fds_[i] = open_event(static_cast<PerfEvent>(i), inherit, false);
+            if (fds_[i] < 0 && (errno == EACCES || errno == EPERM)) {
+                fds_[i] = open_event(static_cast<PerfEvent>(i), inherit, true);
+                if (fds_[i] >= 0) {
+                    kernel_ = false;
+                }
+            }
+            opened += fds_[i] >= 0;
+        }
+        return opened;
+    }
+
+    void close()
+    {
+        for (int& fd : fds_) {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+    }
+
+    // PERF_EVENT_IOC_RESET leaves the counts of exited inherited threads
+    // in place, so each phase is measured against a baseline read here
+    // instead of from zero.
+    void start()
+    {
+        for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+            if (fds_[i] >= 0) {
+                read_raw(fds_[i], base_[i]);
+                ioctl(fds_[i], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    void stop()
+    {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            }
+        }
+    }
+
+    // Counts since the last start()
+    PerfSample read() const
+    {
+        PerfSample sample;
+        for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+            uint64_t data[3];
+            if (fds_[i] < 0 || !read_raw(fds_[i], data)) {
+                continue;
+            }
+            for (int j = 0; j < 3; ++j) {
+                data[j] -= base_[i][j];
+            }
+            if (data[2] == 0) {
+                continue;
+            }
+            sample.values[i] = data[2] < data[1]
+                                   ? static_cast<uint64_t>(static_cast<double>(data[0]) *
+                                                           data[1] / data[2])
+                                   : data[0];
+            sample.valid[i] = true;
+        }
+        return sample;
+    }
+
+    bool is_open() const
+    {
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // "user+kernel" or "user", for labelling printed counters
+    const char* scope() const { return kernel_ ? "user+kernel" : "user"; }
+
+private:
+    // value, time_enabled, time_running
+    static bool read_raw(int fd, uint64_t data[3])
+    {
+        if (::read(fd, data, 3 * sizeof(uint64_t)) != 3 * sizeof(uint64_t)) {
+            std::fill_n(data, 3, 0);
+            return false;
+        }
+        return true;
+    }
+
+    static int open_event(PerfEvent event, bool inherit, bool user_only)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        switch (event) {
+        case PERF_CYCLES:
+            attr.config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_CACHE_MISSES:
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            break;
+        case PERF_BRANCH_MISSES:
+            attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PERF_L1D_MISSES:
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = PERF_COUNT_HW_CACHE_L1D |
+                          (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_CONTEXT_SWITCHES:
+        default:
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+            break;
+        }
+        attr.disabled = 1;
+        attr.inherit = inherit ? 1 : 0;
+        attr.exclude_kernel = user_only ? 1 : 0;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                                        PERF_FLAG_FD_CLOEXEC));
+    }
+
+    int fds_[PERF_EVENT_COUNT];
+    uint64_t base_[PERF_EVENT_COUNT][3] = {};
+    bool kernel_ = true;
+};
+
+// One line of counters, per request when requests > 0
+static inline int format_perf_sample(char* out, size_t size, const PerfSample& sample,
+                                     uint64_t requests)
+{
+    int len = snprintf(out, size, "IPC %.2f", sample.ipc());
+    for (int i = 0; i < PERF_EVENT_COUNT && len >= 0 && static_cast<size_t>(len) < size; ++i) {
+        if (!sample.valid[i]) {
+            continue;
+        }
+        if (requests > 0) {
+            len += snprintf(out + len, size - len, ", %s/req %.1f", kPerfEventNames[i],
+                            sample.per(static_cast<PerfEvent>(i), requests));
+        } else {
+            len += snprintf(out + len, size - len, ", %s %llu", kPerfEventNames[i],
+                            static_cast<unsigned long long>(sample.values[i]));
+        }
+    }
+    return len;
+}
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,424 @@
+// server_dpdk.cpp
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <utility>
+
+#include <arpa/inet.h>
+
+#include <rte_arp.h>
+#include <rte_eal.h>
+#include <rte_ethdev.h>
+#include <rte_ether.h>
+#include <rte_ip.h>
+#include <rte_lcore.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+#include <rte_udp.h>
+
+#include "common.h"
+#include "perf_counters.h"
+#include "server_stats.h"
+
+// Raw DPDK UDP echo: one lcore polls one RX/TX queue pair and turns every
+// request datagram into its reply in place (MAC, IP and port swap, server
+// timestamps), so no TCP/IP stack is involved at all. It is the lower
+// bound that server_fstack.cpp and the kernel servers are compared with.
+// Only what the client's --udp mode needs is handled: ARP requests for
+// our address, and unfragmented IPv4/UDP datagrams to the echo port that
+// hold one whole message. Everything else is dropped.
+
+constexpr uint16_t PORT_ID = 0;
+constexpr int LISTEN_PORT = 8080;
+constexpr uint16_t BURST_SIZE = 32;
+constexpr uint16_t RX_RING_SIZE = 1024;
+constexpr uint16_t TX_RING_SIZE = 1024;
+constexpr unsigned NUM_MBUFS = 8191;
+constexpr unsigned MEMPOOL_CACHE_SIZE = 256;
+constexpr int TX_RETRIES = 4;  // rte_eth_tx_burst() calls before unsent replies are dropped
+
+constexpr const char* STATS_SHM_NAME = "/dpdk_echo_stats";
+constexpr uint64_t STATS_REPORT_NS = 1000000000ull;
+
+struct ServerOptions {
+    uint16_t port = LISTEN_PORT;
+    rte_be32_t ip = 0;  // network order; 0 = answer any address, no ARP
+};
+
+struct ServerContext {
+    ServerOptions opts;
+    rte_ether_addr mac;
+    WorkerStats* stats = nullptr;
+    PerfCounters perf;
+    bool perf_counting = false;
+    uint64_t perf_start_ns = 0;
+    uint64_t perf_start_messages = 0;
+    uint64_t tx_dropped = 0;
+    uint64_t next_report_ns = 0;
+    uint64_t last_messages = 0;
+};
+
+static volatile sig_atomic_t g_quit = 0;
+static volatile sig_atomic_t g_perf_toggle = 0;
+
+static void on_signal(int signum)
+{
+    if (signum == SIGUSR1) {
+        g_perf_toggle = 1;
+    } else {
+        g_quit = 1;
+    }
+}
+
+// Answer a who-has for our address in place. Returns false to drop.
+static bool handle_arp(ServerContext& ctx, rte_mbuf* m)
+{
+    if (ctx.opts.ip == 0 ||
+        rte_pktmbuf_data_len(m) < sizeof(rte_ether_hdr) + sizeof(rte_arp_hdr)) {
+        return false;
+    }
+    auto* eth = rte_pktmbuf_mtod(m, rte_ether_hdr*);
+    auto* arp = rte_pktmbuf_mtod_offset(m, rte_arp_hdr*, sizeof(rte_ether_hdr));
+    if (arp->arp_hardware != rte_cpu_to_be_16(RTE_ARP_HRD_ETHER) ||
+        arp->arp_protocol != rte_cpu_to_be_16(RTE_ETHER_TYPE_IPV4) ||
+        arp->arp_opcode != rte_cpu_to_be_16(RTE_ARP_OP_REQUEST) ||
+        arp->arp_data.arp_tip != ctx.opts.ip) {
+        return false;
+    }
+
+    rte_arp_ipv4& data = arp->arp_data;
+    arp->arp_opcode = rte_cpu_to_be_16(RTE_ARP_OP_REPLY);
+    rte_ether_addr_copy(&data.arp_sha, &data.arp_tha);
+    data.arp_tip = data.arp_sip;
+    rte_ether_addr_copy(&ctx.mac, &data.arp_sha);
+    data.arp_sip = ctx.opts.ip;
+    rte_ether_addr_copy(&eth->src_addr, &eth->dst_addr);
+    rte_ether_addr_copy(&ctx.mac, &eth->src_addr);
+    return true;
+}
+
+// Turn a request datagram into its reply in place. Returns false to drop.
+// Swapping addresses and ports leaves both checksums valid; the UDP one
+// only goes stale when the server timestamps change the payload, and is
+// then cleared, which IPv4 allows.
+static bool handle_ipv4(ServerContext& ctx, rte_mbuf* m, uint64_t recv_ns)
+{
+    const uint32_t len = rte_pktmbuf_data_len(m);
+    if (m->nb_segs != 1 || len < sizeof(rte_ether_hdr) + sizeof(rte_ipv4_hdr)) {
+        return false;
+    }
+    auto* eth = rte_pktmbuf_mtod(m, rte_ether_hdr*);
+    auto* ip = rte_pktmbuf_mtod_offset(m, rte_ipv4_hdr*, sizeof(rte_ether_hdr));
+    const uint32_t ip_len = (ip->version_ihl & RTE_IPV4_HDR_IHL_MASK) * RTE_IPV4_IHL_MULTIPLIER;
+    if (ip->next_proto_id != IPPROTO_UDP ||
+        (ip->fragment_offset & rte_cpu_to_be_16(RTE_IPV4_HDR_MF_FLAG | RTE_IPV4_HDR_OFFSET_MASK)) ||
+        (ctx.opts.ip != 0 && ip->dst_addr != ctx.opts.ip) ||
+        len < sizeof(rte_ether_hdr) + ip_len + sizeof(rte_udp_hdr)) {
+        return false;
+    }
+    auto* udp = rte_pktmbuf_mtod_offset(m, rte_udp_hdr*, sizeof(rte_ether_hdr) + ip_len);
+    const uint32_t dgram_len = rte_be_to_cpu_16(udp->dgram_len);
+    if (udp->dst_port != rte_cpu_to_be_16(ctx.opts.port) ||
+        dgram_len < sizeof(rte_udp_hdr) + sizeof(Msg) ||
+        sizeof(rte_ether_hdr) + ip_len + dgram_len > len) {
+        return false;
+    }
+    const uint32_t payload_len = dgram_len - sizeof(rte_udp_hdr);
+
+    char* payload = reinterpret_cast<char*>(udp + 1);
+    Msg header;
+    std::memcpy(&header, payload, sizeof(header));
+    if (header.payload_size != payload_len) {
+        return false;  // not one whole message, as the other servers treat it
+    }
+    if (msg_wants_server_ts(&header)) {
+        msg_stamp_header(payload, recv_ns, now_ns());
+        udp->dgram_cksum = 0;
+    }
+
+    std::swap(udp->src_port, udp->dst_port);
+    std::swap(ip->src_addr, ip->dst_addr);
+    rte_ether_addr_copy(&eth->src_addr, &eth->dst_addr);
+    rte_ether_addr_copy(&ctx.mac, &eth->src_addr);
+
+    stat_add(ctx.stats->messages, 1);
+    stat_add(ctx.stats->bytes, payload_len);
+    return true;
+}
+
+static bool handle_packet(ServerContext& ctx, rte_mbuf* m, uint64_t recv_ns)
+{
+    if (rte_pktmbuf_data_len(m) < sizeof(rte_ether_hdr)) {
+        return false;
+    }
+    const auto* eth = rte_pktmbuf_mtod(m, const rte_ether_hdr*);
+    switch (rte_be_to_cpu_16(eth->ether_type)) {
+    case RTE_ETHER_TYPE_IPV4:
+        return handle_ipv4(ctx, m, recv_ns);
+    case RTE_ETHER_TYPE_ARP:
+        return handle_arp(ctx, m);
+    default:
+        return false;
+    }
+}
+
+// Replies the TX ring cannot take after a few tries are dropped, like a
+// full socket send queue; the client counts them lost
+static void send_burst(ServerContext& ctx, rte_mbuf** tx, uint16_t count)
+{
+    uint16_t sent = 0;
+    for (int attempt = 0; attempt < TX_RETRIES && sent < count; ++attempt) {
+        sent += rte_eth_tx_burst(PORT_ID, 0, tx + sent, count - sent);
+    }
+    if (unlikely(sent < count)) {
+        rte_pktmbuf_free_bulk(tx + sent, count - sent);
+        stat_add(ctx.stats->send_eagain, count - sent);
+        ctx.tx_dropped += count - sent;
+    }
+}
+
+static void toggle_perf(ServerContext& ctx)
+{
+    if (!ctx.perf.is_open()) {
+        std::fprintf(stderr, "perf counters unavailable\n");
+        return;
+    }
+    const uint64_t now = now_ns();
+    const uint64_t messages = ctx.stats->messages.load(std::memory_order_relaxed);
+    if (!ctx.perf_counting) {
+        ctx.perf.start();
+        ctx.perf_start_ns = now;
+        ctx.perf_start_messages = messages;
+        std::printf("[perf] counting started\n");
+    } else {
+        ctx.perf.stop();
+        const PerfSample sample = ctx.perf.read();
+        const uint64_t served = messages - ctx.perf_start_messages;
+        char line[512];
+        format_perf_sample(line, sizeof(line), sample, served);
+        std::printf("[perf] %.3f s, %" PRIu64 " msgs (%s): %s\n",
+                    (now - ctx.perf_start_ns) / 1e9, served, ctx.perf.scope(), line);
+    }
+    std::fflush(stdout);
+    ctx.perf_counting = !ctx.perf_counting;
+}
+
+static void update_stats(ServerContext& ctx, uint64_t now)
+{
+    if (now < ctx.next_report_ns) {
+        return;
+    }
+    ctx.stats->heartbeat_ns.store(now, std::memory_order_relaxed);
+    const uint64_t messages = ctx.stats->messages.load(std::memory_order_relaxed);
+    if (ctx.next_report_ns != 0 && messages != ctx.last_messages) {
+        const double elapsed_s =
+            static_cast<double>(now - (ctx.next_report_ns - STATS_REPORT_NS)) / 1e9;
+        std::printf("[stats] msgs/s=%.0f total_msgs=%" PRIu64 " tx_dropped=%" PRIu64 "\n",
+                    (messages - ctx.last_messages) / elapsed_s, messages, ctx.tx_dropped);
+        std::fflush(stdout);
+    }
+    ctx.last_messages = messages;
+    ctx.next_report_ns = now + STATS_REPORT_NS;
+}
+
+static void server_loop(ServerContext& ctx)
+{
+    rte_mbuf* rx[BURST_SIZE];
+    rte_mbuf* tx[BURST_SIZE];
+    rte_mbuf* drop[BURST_SIZE];
+
+    while (!g_quit) {
+        const uint64_t loop_start = now_ns();
+        update_stats(ctx, loop_start);
+        stat_add(ctx.stats->loop_iterations, 1);
+        if (g_perf_toggle) {
+            g_perf_toggle = 0;
+            toggle_perf(ctx);
+        }
+
+        const uint16_t nb_rx = rte_eth_rx_burst(PORT_ID, 0, rx, BURST_SIZE);
+        if (nb_rx == 0) {
+            continue;
+        }
+
+        uint16_t nb_tx = 0;
+        uint16_t nb_drop = 0;
+        for (uint16_t i = 0; i < nb_rx; ++i) {
+            if (i + 1 < nb_rx) {
+                rte_prefetch0(rte_pktmbuf_mtod(rx[i + 1], void*));
+            }
+            if (handle_packet(ctx, rx[i], loop_start)) {
+                tx[nb_tx++] = rx[i];
+            } else {
+                drop[nb_drop++] = rx[i];
+            }
+        }
+        if (nb_tx > 0) {
+            send_burst(ctx, tx, nb_tx);
+        }
+        if (nb_drop > 0) {
+            rte_pktmbuf_free_bulk(drop, nb_drop);
+        }
+        stats_busy_iteration(*ctx.stats, loop_start, now_ns());
+    }
+}
+
+static int init_port(uint16_t port_id, rte_mempool* pool)
+{
+    rte_eth_dev_info dev_info;
+    int ret = rte_eth_dev_info_get(port_id, &dev_info);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // rxmode.mtu replaced max_rx_pkt_len in DPDK 21.11; the default MTU
+    // already covers the largest frame the RX mbufs can hold
+    rte_eth_conf port_conf;
+    std::memset(&port_conf, 0, sizeof(port_conf));
+    if (dev_info.tx_offload_capa & RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE) {
+        port_conf.txmode.offloads |= RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE;
+    }
+    ret = rte_eth_dev_configure(port_id, 1, 1, &port_conf);
+    if (ret != 0) {
+        return ret;
+    }
+
+    uint16_t nb_rxd = RX_RING_SIZE;
+    uint16_t nb_txd = TX_RING_SIZE;
+    ret = rte_eth_dev_adjust_nb_rx_tx_desc(port_id, &nb_rxd, &nb_txd);
+    if (ret != 0) {
+        return ret;
+    }
+    const int socket = rte_eth_dev_socket_id(port_id);
+    ret = rte_eth_rx_queue_setup(port_id, 0, nb_rxd, socket, nullptr, pool);
+    if (ret < 0) {
+        return ret;
+    }
+    rte_eth_txconf txconf = dev_info.default_txconf;
+    txconf.offloads = port_conf.txmode.offloads;
+    ret = rte_eth_tx_queue_setup(port_id, 0, nb_txd, socket, &txconf);
+    if (ret < 0) {
+        return ret;
+    }
+    return rte_eth_dev_start(port_id);
+}
+
+static void print_usage(const char* prog)
+{
+    std::fprintf(stderr,
+                 "Usage: %s <EAL options> -- [--ip A.B.C.D] [--port N]\n"
+                 "  --ip A.B.C.D     our address: answer ARP for it and echo only "
+                 "datagrams sent to it\n"
+                 "                   (default: echo any address, no ARP)\n"
+                 "  --port N         UDP port to echo (default %d)\n"
+                 "kill -USR1 starts/stops hardware counters (cycles, IPC, misses)\n",
+                 prog, LISTEN_PORT);
+}
+
+static bool parse_options(int argc, char* argv[], ServerOptions* opts)
+{
+    static const option long_options[] = {
+        {"ip", required_argument, nullptr, 'i'},
+        {"port", required_argument, nullptr, 'p'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "i:p:h", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'i': {
+            in_addr addr;
+            if (inet_pton(AF_INET, optarg, &addr) != 1) {
+                std::fprintf(stderr, "invalid IPv4 address: %s\n", optarg);
+                return false;
+            }
+            opts->ip = addr.s_addr;
+            break;
+        }
+        case 'p': {
+            char* end = nullptr;
+            long value = std::strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0 || value > 65535) {
+                std::fprintf(stderr, "port must be in [1, 65535]\n");
+                return false;
+            }
+            opts->port = static_cast<uint16_t>(value);
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return optind == argc;
+}
+
+int main(int argc, char* argv[])
+{
+    int ret = rte_eal_init(argc, argv);
+    if (ret < 0) {
+        rte_exit(EXIT_FAILURE, "Invalid EAL arguments\n");
+    }
+    argc -= ret;
+    argv += ret;
+
+    static ServerContext ctx;
+    if (!parse_options(argc, argv, &ctx.opts)) {
+        print_usage(argv[0]);
+        rte_eal_cleanup();
+        return 1;
+    }
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::signal(SIGUSR1, on_signal);
+
+    if (!rte_eth_dev_is_valid_port(PORT_ID)) {
+        rte_exit(EXIT_FAILURE, "No Ethernet port %u (bind a NIC or pass --vdev)\n", PORT_ID);
+    }
+    rte_mempool* pool = rte_pktmbuf_pool_create("MBUF_POOL", NUM_MBUFS, MEMPOOL_CACHE_SIZE, 0,
+                                                RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+    if (pool == nullptr) {
+        rte_exit(EXIT_FAILURE, "Cannot create mbuf pool: %s\n", rte_strerror(rte_errno));
+    }
+    ret = init_port(PORT_ID, pool);
+    if (ret != 0) {
+        rte_exit(EXIT_FAILURE, "Cannot start port %u: %s\n", PORT_ID, rte_strerror(-ret));
+    }
+    rte_eth_macaddr_get(PORT_ID, &ctx.mac);
+
+    clock_init();
+    StatsRegion* region = stats_map(STATS_SHM_NAME, true, 1);
+    if (region == nullptr) {
+        return 1;
+    }
+    ctx.stats = &region->slots[0];
+    stats_reset(*ctx.stats, now_ns());
+    // Counters follow the calling thread, which runs the whole datapath
+    ctx.perf.open(false);
+
+    char mac[RTE_ETHER_ADDR_FMT_SIZE];
+    rte_ether_format_addr(mac, sizeof(mac), &ctx.mac);
+    char ip[INET_ADDRSTRLEN] = "any";
+    if (ctx.opts.ip != 0) {
+        inet_ntop(AF_INET, &ctx.opts.ip, ip, sizeof(ip));
+    }
+    std::printf("DPDK echo server on port %u (%s), lcore %u, %s:%u/udp\n",
+                PORT_ID, mac, rte_lcore_id(), ip, ctx.opts.port);
+    std::printf("Minimum total message size: %zu bytes\n", sizeof(Msg));
+    std::printf("Timestamp clock: %s\n", clock_source_name());
+    std::printf("Live stats: ./stats_reader %s\n", STATS_SHM_NAME);
+    std::fflush(stdout);
+
+    server_loop(ctx);
+
+    std::printf("\nStopping port %u, %" PRIu64 " messages echoed, %" PRIu64 " replies dropped\n",
+                PORT_ID, ctx.stats->messages.load(std::memory_order_relaxed), ctx.tx_dropped);
+    rte_eth_dev_stop(PORT_ID);
+    rte_eth_dev_close(PORT_ID);
+    rte_eal_cleanup();
+    return 0;
+}
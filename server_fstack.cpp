@@ -1,299 +1,577 @@
 // server_fstack.cpp
 #include <array>
+#include <atomic>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <vector>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utility>
 
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#include "buffer_pool.h"
 #include "common.h"
+#include "perf_counters.h"
+#include "server_stats.h"
+#include "transport.h"
 #include <ff_api.h>
 
 constexpr int LISTEN_PORT = 8080;
 constexpr int BACKLOG = 1024;
-constexpr int MAX_CLIENTS = 1024;
+constexpr int MAX_CLIENTS = 8192;
+constexpr int MAX_EVENTS = 512;
+
+// Per-connection buffers come from slabs of CONN_BUFFER_SIZE blocks; only
+// frames larger than a block need their own heap buffer.
+constexpr size_t CONN_BUFFER_SIZE = 16 * 1024;
+constexpr size_t BUFFER_SLAB_BLOCKS = 256;
+
+// UDP echo on the same port: at most UDP_BATCH datagrams per loop iteration
+constexpr int UDP_BATCH = 32;
+constexpr size_t UDP_MAX_DATAGRAM = 65536;
+
+// One F-Stack process per lcore (--proc-id), each owning slot proc_id of
+// one stats segment (server_stats.h; watch it with stats_reader)
+constexpr const char* STATS_SHM_NAME = "/fstack_echo_stats";
+constexpr uint64_t STATS_REPORT_NS = 1000000000ull;
+constexpr uint64_t STATS_STALE_NS = 3 * STATS_REPORT_NS;
 
 // Must match [port0].addr in config.ini
 //static const char *g_bind_ip = "192.168.5.220";
 
-static int g_listenfd = -1;
+// Per-connection state: the framing state shared with server_kernel.cpp
+// plus which kevent filters are enabled
+struct ClientState : EchoConn {
+    bool read_armed = true;    // EVFILT_READ paused while recv_buffer is full
+    bool write_armed = false;  // EVFILT_WRITE enabled while a send is blocked
+};
 
-// Per-connection state
-struct ClientState {
-    int fd = -1;
-    std::vector<char> recv_buffer;
-    size_t recv_bytes = 0;
-    size_t expected_size = sizeof(Msg);
-    std::vector<char> send_buffer;
-    size_t send_bytes = 0;
-    bool has_full_msg = false;
+// Everything one server instance owns. Each lcore runs its own process
+// with its own ServerContext; RSS on the NIC spreads flows across them.
+struct ServerContext {
+    int proc_id = 0;
+    int listenfd = -1;
+    int udpfd = -1;
+    int kq = -1;
+
+    // Slots are handed out from a free list; kevent udata points at the slot
+    std::array<ClientState, MAX_CLIENTS> clients{};
+    std::array<int, MAX_CLIENTS> free_slots{};
+    int free_count = 0;
+    int client_count = 0;
+
+    BufferPool pool{CONN_BUFFER_SIZE, BUFFER_SLAB_BLOCKS};
+    std::array<char, UDP_MAX_DATAGRAM> datagram{};
+
+    StatsRegion* stats_region = nullptr;
+    WorkerStats* stats = nullptr;
+
+    // Aggregated view, printed by proc 0 only
+    uint64_t next_report_ns = 0;
+    uint64_t last_messages = 0;
+    uint64_t last_bytes = 0;
+    uint64_t last_allocs = 0;
+
+    // SIGUSR1 starts and stops perf_event_open counting of this process
+    PerfCounters perf;
+    bool perf_counting = false;
+    uint64_t perf_start_ns = 0;
+    uint64_t perf_start_messages = 0;
 };
 
-static std::array<ClientState, MAX_CLIENTS> g_client_states{};
-static int g_client_count = 0;
+static volatile sig_atomic_t g_perf_toggle = 0;
 
-// Helper: remove fd from the array
-static void remove_client_at(int idx)
+static void on_sigusr1(int)
 {
-    if (idx < 0 || idx >= g_client_count)
-        return;
+    g_perf_toggle = 1;
+}
 
-    ClientState& state = g_client_states[idx];
-    if (state.fd >= 0) {
-        ff_close(state.fd);
+static ServerContext g_ctx;
+
+static void init_client_slots(ServerContext& ctx)
+{
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        ctx.free_slots[i] = MAX_CLIENTS - 1 - i;
     }
+    ctx.free_count = MAX_CLIENTS;
+}
 
-    // Replace removed entry with the last one
-    if (idx < g_client_count - 1) {
-        g_client_states[idx] = std::move(g_client_states[g_client_count - 1]);
+static bool update_event(ServerContext& ctx, int fd, short filter,
+                         unsigned short flags, void* udata)
+{
+    struct kevent change;
+    EV_SET(&change, fd, filter, flags, 0, 0, udata);
+    if (ff_kevent(ctx.kq, &change, 1, nullptr, 0, nullptr) < 0) {
+        perror("ff_kevent");
+        return false;
     }
-    // Reset the final slot state
-    g_client_states[g_client_count - 1] = ClientState{};
-    g_client_count--;
+    return true;
 }
 
-// Receive a complete message (non-blocking)
-// Returns: -1=error, 0=need more data, 1=got full message
-static int recv_message(ClientState& state, int idx)
+// Helper: close the connection and return its slot to the free list
+static void remove_client(ServerContext& ctx, ClientState& state)
 {
-    // Already have a full message buffered
-    if (state.has_full_msg) {
-        return 1;
+    if (state.fd >= 0) {
+        // Closing the fd also drops its kevent registrations
+        ff_close(state.fd);
+    }
+
+    ctx.pool.release(&state.recv_buffer);
+    ctx.pool.release(&state.send_buffer);
+    state = ClientState{};
+    ctx.free_slots[ctx.free_count++] = static_cast<int>(&state - ctx.clients.data());
+    ctx.client_count--;
+    stat_add(ctx.stats->closed, 1);
+}
+
+// An F-Stack socket as a transport for the framing helpers in transport.h.
+// F-Stack reports a would-block on a non-blocking socket as EPERM as well
+// as EAGAIN.
+struct FStackSocket {
+    static constexpr const char* kRecvCall = "ff_recv";
+    static constexpr const char* kSendCall = "ff_writev";
+
+    int fd = -1;
+
+    ssize_t recv(void* buffer, size_t len) { return ff_recv(fd, buffer, len, 0); }
+    ssize_t send(const void* buffer, size_t len)
+    {
+        struct iovec iov = {const_cast<void*>(buffer), len};
+        return ff_writev(fd, &iov, 1);
     }
+    ssize_t sendv(const struct iovec* iov, int iovcnt) { return ff_writev(fd, iov, iovcnt); }
+    static bool would_block(int err) { return err == EAGAIN || err == EPERM; }
+    bool wait() { return true; }
+};
 
-    if (state.recv_buffer.size() < state.expected_size) {
-        state.recv_buffer.resize(state.expected_size);
+// Run recv+echo for a client that kevent reported as ready
+static void process_one_client(ServerContext& ctx, ClientState& state)
+{
+    FStackSocket sock{state.fd};
+
+    // 1. Flush replies that were blocked earlier
+    int send_result = send_pending(sock, ctx.pool, state, *ctx.stats);
+    if (send_result < 0) {
+        remove_client(ctx, state);
+        return;
     }
 
-    while (state.recv_bytes < state.expected_size) {
-        ssize_t n = ff_recv(state.fd,
-                            state.recv_buffer.data() + state.recv_bytes,
-                            state.expected_size - state.recv_bytes,
-                            0);
+    // 2. Read everything available and queue every complete frame
+    if (recv_available(sock, state, *ctx.stats) < 0 ||
+        !stage_replies(ctx.pool, state, *ctx.stats)) {
+        remove_client(ctx, state);
+        return;
+    }
 
-        if (n > 0) {
-            state.recv_bytes += n;
+    // 3. Echo all queued frames with a single send
+    if (send_result > 0) {
+        send_result = send_pending(sock, ctx.pool, state, *ctx.stats);
+        if (send_result < 0) {
+            remove_client(ctx, state);
+            return;
+        }
+    }
 
-            if (state.recv_bytes == sizeof(Msg) &&
-                state.expected_size == sizeof(Msg)) {
-                auto* header = reinterpret_cast<Msg*>(state.recv_buffer.data());
-                if (header->payload_size < sizeof(Msg)) {
-                    std::fprintf(stderr,
-                                 "client fd=%d payload_size=%" PRIu32 " below header size %zu\n",
-                                 state.fd, header->payload_size, sizeof(Msg));
-                    remove_client_at(idx);
-                    return -1;
-                }
+    // Only ask for EVFILT_WRITE while replies are stuck. Read stays
+    // level-triggered, so bytes left in the socket are reported again,
+    // but it is paused while recv_buffer is full to avoid spinning.
+    const bool want_write = (send_result == 0);
+    if (want_write != state.write_armed &&
+        update_event(ctx, state.fd, EVFILT_WRITE, want_write ? EV_ENABLE : EV_DISABLE,
+                     &state)) {
+        state.write_armed = want_write;
+    }
 
-                state.expected_size = header->payload_size;
-                state.recv_buffer.resize(state.expected_size);
+    const bool want_read = state.recv_bytes < state.recv_buffer.capacity;
+    if (want_read != state.read_armed &&
+        update_event(ctx, state.fd, EVFILT_READ, want_read ? EV_ENABLE : EV_DISABLE,
+                     &state)) {
+        state.read_armed = want_read;
+    }
+}
+static void accept_clients(ServerContext& ctx)
+{
+    // Accept as many new connections as possible per event
+    for (;;) {
+        int cfd = ff_accept(ctx.listenfd, nullptr, nullptr);
+        if (cfd < 0) {
+            if (errno == ECONNABORTED) {
+                continue;  // Reset before we got to it; take the next one
             }
-        } else if (n == 0) {
-            std::fprintf(stderr, "client fd=%d closed (recv)\n", state.fd);
-            remove_client_at(idx);
-            return -1;
-        } else {
-            if (errno == EINTR) {
-                continue;
+            if (errno == EAGAIN || errno == EINTR || errno == EPERM) {
+                // No more pending connections
+                break;
+            }
+            perror("ff_accept");
+            break;
+        }
+
+        if (ctx.free_count == 0) {
+            std::fprintf(stderr, "too many clients, closing fd=%d\n", cfd);
+            ff_close(cfd);
+            continue;
+        }
+
+        // Nagle off, as in server_kernel (see socket_nodelay())
+        const int one = 1;
+        ff_setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        // Initialize new client state
+        ClientState& state = ctx.clients[ctx.free_slots[--ctx.free_count]];
+        state.fd = cfd;
+        state.recv_bytes = 0;
+        state.ready = 0;
+        state.send_size = 0;
+        state.send_bytes = 0;
+        state.read_armed = true;
+        state.write_armed = false;
+        ctx.client_count++;
+        stat_add(ctx.stats->accepted, 1);
+
+        if (!ctx.pool.acquire(&state.recv_buffer, CONN_BUFFER_SIZE) ||
+            !ctx.pool.acquire(&state.send_buffer, CONN_BUFFER_SIZE)) {
+            std::fprintf(stderr, "out of buffers, closing fd=%d\n", cfd);
+            remove_client(ctx, state);
+            continue;
+        }
+
+        struct kevent changes[2];
+        EV_SET(&changes[0], cfd, EVFILT_READ, EV_ADD, 0, 0, &state);
+        EV_SET(&changes[1], cfd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, &state);
+        if (ff_kevent(ctx.kq, changes, 2, nullptr, 0, nullptr) < 0) {
+            perror("ff_kevent add client");
+            remove_client(ctx, state);
+            continue;
+        }
+        // printf("new client fd=%d, total=%d\n", cfd, ctx.client_count);
+    }
+}
+
+// Echo queued datagrams back to their senders. Each datagram is one
+// whole message; anything else is dropped, as the client counts it lost.
+static void serve_udp(ServerContext& ctx)
+{
+    for (int i = 0; i < UDP_BATCH; ++i) {
+        sockaddr_in from{};
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = ff_recvfrom(ctx.udpfd, ctx.datagram.data(), ctx.datagram.size(), 0,
+                                reinterpret_cast<struct linux_sockaddr *>(&from), &fromlen);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stat_add(ctx.stats->recv_eagain, 1);
+            } else if (errno != EINTR) {
+                perror("ff_recvfrom");
             }
-            if (errno == EAGAIN || errno == EPERM) {
-                return 0;
+            return;
+        }
+        const uint64_t recv_ns = now_ns();
+        const size_t len = static_cast<size_t>(n);
+        if (len < sizeof(Msg) ||
+            reinterpret_cast<const Msg*>(ctx.datagram.data())->payload_size != len) {
+            continue;
+        }
+        msg_stamp_header(ctx.datagram.data(), recv_ns, now_ns());
+        if (ff_sendto(ctx.udpfd, ctx.datagram.data(), len, 0,
+                      reinterpret_cast<struct linux_sockaddr *>(&from), fromlen) < 0) {
+            // Full send queue: the datagram is lost, like on the wire
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stat_add(ctx.stats->send_eagain, 1);
             }
-            perror("ff_recv");
-            remove_client_at(idx);
-            return -1;
+            continue;
         }
+        stat_add(ctx.stats->messages, 1);
+        stat_add(ctx.stats->bytes, len);
     }
+}
 
-    state.send_buffer = state.recv_buffer;
-    state.send_bytes = 0;
-    state.has_full_msg = true;
+static int init_udp_socket(ServerContext& ctx)
+{
+    ctx.udpfd = ff_socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctx.udpfd < 0) {
+        perror("ff_socket udp");
+        return -1;
+    }
 
-    state.recv_buffer.assign(sizeof(Msg), 0);
-    state.expected_size = sizeof(Msg);
-    state.recv_bytes = 0;
+    int on = 1;
+    if (ff_ioctl(ctx.udpfd, FIONBIO, &on) < 0) {
+        perror("ff_ioctl FIONBIO");
+        return -1;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(LISTEN_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (ff_bind(ctx.udpfd,
+                reinterpret_cast<struct linux_sockaddr *>(&addr),
+                sizeof(addr)) < 0) {
+        perror("ff_bind udp");
+        return -1;
+    }
 
-    return 1;
+    if (!update_event(ctx, ctx.udpfd, EVFILT_READ, EV_ADD, nullptr)) {
+        return -1;
+    }
+    return 0;
 }
 
-// Send a complete message (non-blocking)
-// Returns: -1=error, 0=in progress, 1=done
-static int send_message(ClientState& state, int idx)
+static int init_listen_socket(ServerContext& ctx)
 {
-    if (!state.has_full_msg) {
-        return 1;  // Nothing to send
+    ctx.listenfd = ff_socket(AF_INET, SOCK_STREAM, 0);
+    if (ctx.listenfd < 0) {
+        perror("ff_socket");
+        return -1;
     }
 
-    if (state.send_buffer.empty()) {
-        state.has_full_msg = false;
-        return 1;
+    const int yes = 1;
+    if (ff_setsockopt(ctx.listenfd, SOL_SOCKET, SO_REUSEADDR,
+                      &yes, sizeof(yes)) < 0) {
+        perror("ff_setsockopt");
+        return -1;
     }
 
-    while (state.send_bytes < state.send_buffer.size()) {
-        ssize_t n = ff_send(state.fd,
-                           state.send_buffer.data() + state.send_bytes,
-                           state.send_buffer.size() - state.send_bytes,
-                           0);
-        
-        if (n > 0) {
-            state.send_bytes += n;
-        } else if (n == 0) {
-            // Peer closed the connection
-            std::fprintf(stderr, "client fd=%d closed (send)\n", state.fd);
-            remove_client_at(idx);
-            return -1;
-        } else {
-            // n < 0
-            if (errno == EINTR) {
-                continue;
-            }
-            if (errno == EAGAIN || errno == EPERM) {
-                // Can't send now; retry on next loop
-                return 0;
-            }
-            perror("ff_send");
-            remove_client_at(idx);
-            return -1;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(LISTEN_PORT);
+
+    // if (inet_pton(AF_INET, g_bind_ip, &addr.sin_addr) != 1) {
+    //     perror("inet_pton g_bind_ip");
+    //     return -1;
+    // }
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (ff_bind(ctx.listenfd,
+                reinterpret_cast<struct linux_sockaddr *>(&addr),
+                sizeof(addr)) < 0) {
+        perror("ff_bind");
+        return -1;
+    }
+
+    if (ff_listen(ctx.listenfd, BACKLOG) < 0) {
+        perror("ff_listen");
+        return -1;
+    }
+
+    ctx.kq = ff_kqueue();
+    if (ctx.kq < 0) {
+        perror("ff_kqueue");
+        return -1;
+    }
+
+    if (!update_event(ctx, ctx.listenfd, EVFILT_READ, EV_ADD, nullptr)) {
+        return -1;
+    }
+
+    if (init_udp_socket(ctx) < 0) {
+        return -1;
+    }
+
+    init_client_slots(ctx);
+
+    std::printf("F-Stack simple echo server (proc %d) listening on %d (TCP and UDP)\n",
+                ctx.proc_id, LISTEN_PORT);
+    std::fprintf(stdout, "Msg header size: %zu bytes\n", sizeof(Msg));
+    return 0;
+}
+
+// Proc 0 periodically sums every live process slot into one line
+static void report_aggregated_stats(ServerContext& ctx, uint64_t now)
+{
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    uint64_t active = 0;
+    uint64_t allocs = 0;
+    int live_procs = 0;
+    for (const WorkerStats& p : ctx.stats_region->slots) {
+        const uint64_t heartbeat = p.heartbeat_ns.load(std::memory_order_relaxed);
+        if (heartbeat == 0 || now - heartbeat > STATS_STALE_NS) {
+            continue;
         }
+        live_procs++;
+        messages += p.messages.load(std::memory_order_relaxed);
+        bytes += p.bytes.load(std::memory_order_relaxed);
+        allocs += p.buffer_allocs.load(std::memory_order_relaxed);
+        active += p.accepted.load(std::memory_order_relaxed) -
+                  p.closed.load(std::memory_order_relaxed);
     }
-    
-    // Send complete; reset state
-    state.send_bytes = 0;
-    state.has_full_msg = false;
-    state.send_buffer.clear();
-    
-    return 1;
+
+    const double elapsed_s =
+        static_cast<double>(now - (ctx.next_report_ns - STATS_REPORT_NS)) / 1e9;
+    std::printf("[stats] procs=%d conns=%" PRIu64 " msgs/s=%.0f MB/s=%.2f "
+                "total_msgs=%" PRIu64 " buffer_allocs=%" PRIu64 " (+%" PRIu64 ")\n",
+                live_procs, active,
+                (messages - ctx.last_messages) / elapsed_s,
+                (bytes - ctx.last_bytes) / elapsed_s / 1e6,
+                messages, allocs, allocs - ctx.last_allocs);
+    ctx.last_messages = messages;
+    ctx.last_bytes = bytes;
+    ctx.last_allocs = allocs;
 }
 
-// Run one non-blocking recv+echo attempt for a single client
-static void process_one_client(int idx)
+static void update_stats(ServerContext& ctx, uint64_t now)
 {
-    ClientState& state = g_client_states[idx];
-    
-    // 1. Attempt to receive a complete message
-    int recv_result = recv_message(state, idx);
-    if (recv_result < 0) {
-        return;  // Error or need more data
-    }
-    
-    // 2. Attempt to send the message
-    int send_result = send_message(state, idx);
-    if (send_result < 0) {
-        return;  // Error
+    if (now < ctx.next_report_ns) {
+        return;
+    }
+
+    ctx.stats->heartbeat_ns.store(now, std::memory_order_relaxed);
+    ctx.stats->buffer_allocs.store(ctx.pool.allocations(), std::memory_order_relaxed);
+    if (ctx.proc_id == 0 && ctx.next_report_ns != 0) {
+        report_aggregated_stats(ctx, now);
     }
-    
-    // Continue next loop if still sending
+    ctx.next_report_ns = now + STATS_REPORT_NS;
+}
+
+// The lcore thread runs the whole F-Stack datapath, NIC polling included,
+// so counting it alone covers every cycle spent per message
+static void toggle_perf(ServerContext& ctx)
+{
+    if (!ctx.perf.is_open()) {
+        std::fprintf(stderr, "proc %d: perf counters unavailable\n", ctx.proc_id);
+        return;
+    }
+    const uint64_t now = now_ns();
+    const uint64_t messages = ctx.stats->messages.load(std::memory_order_relaxed);
+    if (!ctx.perf_counting) {
+        ctx.perf.start();
+        ctx.perf_start_ns = now;
+        ctx.perf_start_messages = messages;
+        std::printf("[perf] proc %d counting started\n", ctx.proc_id);
+    } else {
+        ctx.perf.stop();
+        const PerfSample sample = ctx.perf.read();
+        const uint64_t served = messages - ctx.perf_start_messages;
+        char line[512];
+        format_perf_sample(line, sizeof(line), sample, served);
+        std::printf("[perf] proc %d %.3f s, %" PRIu64 " msgs (%s): %s\n", ctx.proc_id,
+                    (now - ctx.perf_start_ns) / 1e9, served, ctx.perf.scope(), line);
+    }
+    std::fflush(stdout);
+    ctx.perf_counting = !ctx.perf_counting;
 }
 
 static int server_loop(void *arg)
 {
-    (void)arg;
-
-    // Initialize the listen fd on first call
-    if (g_listenfd < 0) {
-        g_listenfd = ff_socket(AF_INET, SOCK_STREAM, 0);
-        if (g_listenfd < 0) {
-            perror("ff_socket");
-            return -1;
+    ServerContext& ctx = *static_cast<ServerContext*>(arg);
+
+    // Initialize the listen fd and kqueue on first call
+    if (ctx.listenfd < 0 && init_listen_socket(ctx) < 0) {
+        return -1;
+    }
+
+    const uint64_t loop_start = now_ns();
+    update_stats(ctx, loop_start);
+    stat_add(ctx.stats->loop_iterations, 1);
+    if (g_perf_toggle) {
+        g_perf_toggle = 0;
+        toggle_perf(ctx);
+    }
+
+    // Only sockets with pending work are reported, so the cost of a loop
+    // iteration does not grow with the number of idle connections.
+    static struct kevent events[MAX_EVENTS];
+    static const timespec no_wait{0, 0};
+    int nevents = ff_kevent(ctx.kq, nullptr, 0, events, MAX_EVENTS, &no_wait);
+    if (nevents < 0) {
+        if (errno != EINTR) {
+            perror("ff_kevent");
         }
+        return 0;
+    }
+
+    for (int i = 0; i < nevents; ++i) {
+        const struct kevent& event = events[i];
+        const int fd = static_cast<int>(event.ident);
 
-        const int yes = 1;
-        if (ff_setsockopt(g_listenfd, SOL_SOCKET, SO_REUSEADDR,
-                          &yes, sizeof(yes)) < 0) {
-            perror("ff_setsockopt");
-            return -1;
+        if (fd == ctx.listenfd) {
+            accept_clients(ctx);
+            continue;
+        }
+        if (fd == ctx.udpfd) {
+            serve_udp(ctx);
+            continue;
         }
 
-        sockaddr_in addr{};
-        addr.sin_family = AF_INET;
-        addr.sin_port   = htons(LISTEN_PORT);
-
-        // if (inet_pton(AF_INET, g_bind_ip, &addr.sin_addr) != 1) {
-        //     perror("inet_pton g_bind_ip");
-        //     return -1;
-        // }
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-        if (ff_bind(g_listenfd,
-                    reinterpret_cast<struct linux_sockaddr *>(&addr),
-                    sizeof(addr)) < 0) {
-            perror("ff_bind");
-            return -1;
+        auto* state = static_cast<ClientState*>(event.udata);
+        if (state == nullptr || state->fd != fd) {
+            continue;  // Stale event for a client closed earlier in this batch
         }
 
-        if (ff_listen(g_listenfd, BACKLOG) < 0) {
-            perror("ff_listen");
-            return -1;
+        if ((event.flags & EV_ERROR) && event.data != 0) {
+            std::fprintf(stderr, "client fd=%d error %d\n", fd,
+                         static_cast<int>(event.data));
+            remove_client(ctx, *state);
+            continue;
         }
 
-        std::printf("F-Stack simple echo server listening on %d\n",
-                    LISTEN_PORT);
-        std::fprintf(stdout, "Msg header size: %zu bytes\n", sizeof(Msg));
+        // EV_EOF with no data left: recv() returns 0 and closes the client
+        process_one_client(ctx, *state);
     }
 
-    // 1) Accept as many new connections as possible per loop
-    for (;;) {
-        int cfd = ff_accept(g_listenfd, nullptr, nullptr);
-        if (cfd < 0) {
-            if (errno == EAGAIN || errno == EINTR || errno == EPERM) {
-                // No more pending connections
-                break;
-            }
-            perror("ff_accept");
-            break;
-        }
+    if (nevents > 0) {
+        stats_busy_iteration(*ctx.stats, loop_start, now_ns());
+    }
+    return 0;
+}
 
-        if (g_client_count >= MAX_CLIENTS) {
-            std::fprintf(stderr, "too many clients, closing fd=%d\n", cfd);
-            ff_close(cfd);
-            continue;
+// F-Stack parses --proc-id itself; we only peek at it to pick a stats slot
+static int parse_proc_id(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (std::strncmp(arg, "--proc-id=", 10) == 0) {
+            return std::atoi(arg + 10);
         }
-
-        // Initialize new client state
-        ClientState& state = g_client_states[g_client_count];
-        state.fd = cfd;
-        state.recv_bytes = 0;
-        state.expected_size = sizeof(Msg);
-        state.recv_buffer.assign(sizeof(Msg), 0);
-        state.send_bytes = 0;
-        state.send_buffer.clear();
-        state.has_full_msg = false;
-        
-        g_client_count++;
-        // printf("new client fd=%d, total=%d\n", cfd, g_client_count);
-    }
-
-    // 2) Walk every connected client in this loop
-    int idx = 0;
-    while (idx < g_client_count) {
-        int current_client_count = g_client_count;  // Save current value
-        
-        process_one_client(idx);
-        
-        // If a client was removed, g_client_count shrinks
-        // If the current client remains, move to the next one
-        if (g_client_count == current_client_count) {
-            // Client not removed
-            idx++;
+        if ((std::strcmp(arg, "--proc-id") == 0 || std::strcmp(arg, "-p") == 0) &&
+            i + 1 < argc) {
+            return std::atoi(argv[i + 1]);
         }
-        // If a client was removed, idx stays because next client moved here
     }
-
     return 0;
 }
 
+// Every process maps the same segment and writes only slots[proc_id]
+static bool attach_stats(ServerContext& ctx)
+{
+    ctx.stats_region = stats_map(STATS_SHM_NAME, true, STATS_MAX_WORKERS);
+    if (ctx.stats_region == nullptr) {
+        return false;
+    }
+    ctx.stats = &ctx.stats_region->slots[ctx.proc_id];
+    stats_reset(*ctx.stats, now_ns());
+    return true;
+}
+
 int main(int argc, char *argv[])
 {
+    g_ctx.proc_id = parse_proc_id(argc, argv);
+    if (g_ctx.proc_id < 0 || g_ctx.proc_id >= STATS_MAX_WORKERS) {
+        std::fprintf(stderr, "proc-id must be in [0, %d)\n", STATS_MAX_WORKERS);
+        return 1;
+    }
+
     int ret = ff_init(argc, argv);
     if (ret < 0) {
         std::fprintf(stderr, "ff_init failed\n");
         return 1;
     }
 
-    ff_run(server_loop, nullptr);
+    clock_init();
+    if (!attach_stats(g_ctx)) {
+        return 1;
+    }
+
+    // Counters follow the calling thread, which ff_run() turns into the lcore loop
+    g_ctx.perf.open(false);
+    std::signal(SIGUSR1, on_sigusr1);
+
+    ff_run(server_loop, &g_ctx);
     return 0;
 }
@@ -1,152 +1,1171 @@
 // server_kernel.cpp
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <cinttypes>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <string>
+#include <thread>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+#ifdef WITH_IO_URING
+#include <liburing.h>
+#endif
+
+#include "buffer_pool.h"
 #include "common.h"
+#include "perf_counters.h"
+#include "server_stats.h"
+#include "transport.h"
 
 constexpr int LISTEN_PORT = 8080;
 constexpr int BACKLOG = 1024;
+constexpr int MAX_EVENTS = 256;
+constexpr size_t CONN_BUFFER_SIZE = 16 * 1024;
+constexpr size_t BUFFER_SLAB_BLOCKS = 256;
+constexpr int UDP_BATCH = 32;
+constexpr size_t UDP_MAX_DATAGRAM = 65536;
+constexpr int UDP_SOCKET_BUFFER = 4 * 1024 * 1024;  // capped by net.core.[rw]mem_max
+
+enum class ServerMode {
+    Blocking,  // one connection at a time, blocking recv/send
+    Epoll,     // non-blocking, edge-triggered epoll over all connections
+    Uring,     // io_uring multishot accept/recv (needs -DWITH_IO_URING)
+    Udp,       // datagram echo, batched with recvmmsg/sendmmsg
+};
+
+struct ServerOptions {
+    ServerMode mode = ServerMode::Blocking;
+    int port = LISTEN_PORT;
+    int threads = 1;
+    std::vector<int> cpus;  // worker i is pinned to cpus[i % cpus.size()]
+    bool sqpoll = false;         // io_uring: kernel SQ polling thread
+    bool fixed_buffers = false;  // io_uring: registered buffers for sends
+    bool perf = false;           // SIGUSR1 toggles perf_event_open counting
+    int busy_poll_us = 0;        // > 0: busy-poll mode, see socket_busy_poll()
+};
 
-static bool recv_all_bytes(int fd, char* buffer, size_t len)
+// Per-connection state for the epoll mode (same framing as server_fstack.cpp)
+using ClientState = EchoConn;
+
+// Blocking mode: echo_stream() over the socket, then close it.
+// In busy-poll mode the socket is non-blocking and an empty recv spins.
+static void handle_conn(int fd, std::vector<char>& buffer, WorkerStats& stats)
 {
-    size_t received = 0;
-    while (received < len) {
-        ssize_t n = recv(fd, buffer + received, len - received, 0);
-        if (n == 0) {
+    KernelSocket sock{fd};
+    echo_stream(sock, buffer, stats);
+    close(fd);
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl O_NONBLOCK");
+        return false;
+    }
+    return true;
+}
+
+// Busy-poll socket options, complaining only the first time the kernel
+// refuses one (no CAP_NET_ADMIN, or a kernel without the option)
+static void apply_busy_poll(int fd, int usecs, bool tcp)
+{
+    static std::atomic<bool> warned{false};
+    if (socket_busy_poll(fd, usecs, tcp ? 1 : 0) > 0 && !warned.exchange(true)) {
+        std::fprintf(stderr, "busy-poll: socket option refused (%s); raising SO_BUSY_POLL "
+                     "above net.core.busy_read needs CAP_NET_ADMIN\n", std::strerror(errno));
+    }
+}
+
+// With EPOLLET we only get woken on new readiness, so keep going until
+// either the socket is drained or a send reports EAGAIN.
+// Returns false when the connection must be closed.
+static bool service_client(BufferPool& pool, ClientState& state, WorkerStats& stats)
+{
+    KernelSocket sock{state.fd};
+    for (;;) {
+        int send_result = send_pending(sock, pool, state, stats);
+        if (send_result < 0) {
             return false;
         }
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;
-            }
-            perror("recv");
+
+        int recv_result = recv_available(sock, state, stats);
+        if (recv_result < 0) {
+            return false;
+        }
+        if (!stage_replies(pool, state, stats)) {
             return false;
         }
 
-        received += static_cast<size_t>(n);
+        if (send_result > 0) {
+            send_result = send_pending(sock, pool, state, stats);
+            if (send_result < 0) {
+                return false;
+            }
+        }
+        if (send_result == 0) {
+            return true;  // wait for EPOLLOUT
+        }
+        if (recv_result == 0) {
+            return true;  // wait for EPOLLIN
+        }
+        // recv_buffer was full and the replies went out: read the rest
     }
+}
 
-    return true;
+static void close_client(BufferPool& pool, ClientState* state, WorkerStats& stats)
+{
+    stat_add(stats.closed, 1);
+    // close() drops the fd from the epoll set as well
+    close(state->fd);
+    pool.release(&state->recv_buffer);
+    pool.release(&state->send_buffer);
+    delete state;
 }
 
-static bool send_all_bytes(int fd, const char* buffer, size_t len)
+static void accept_clients(BufferPool& pool, int listen_fd, int epfd, int busy_poll_us,
+                           WorkerStats& stats)
 {
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t n = send(fd, buffer + sent, len - sent, 0);
-        if (n == 0) {
-            return false;
+    for (;;) {
+        int conn_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+        if (conn_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept4");
+            }
+            return;
+        }
+
+        stat_add(stats.accepted, 1);
+        socket_nodelay(conn_fd);
+        if (busy_poll_us > 0) {
+            apply_busy_poll(conn_fd, busy_poll_us, true);
         }
+        auto* state = new ClientState;
+        state->fd = conn_fd;
+        if (!pool.acquire(&state->recv_buffer, CONN_BUFFER_SIZE) ||
+            !pool.acquire(&state->send_buffer, CONN_BUFFER_SIZE)) {
+            std::fprintf(stderr, "out of buffers, closing fd=%d\n", conn_fd);
+            close_client(pool, state, stats);
+            continue;
+        }
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = state;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn_fd, &ev) < 0) {
+            perror("epoll_ctl ADD client");
+            close_client(pool, state, stats);
+        }
+    }
+}
+
+// Busy-poll mode never sleeps in epoll_wait; with epoll busy polling
+// (6.9+) every call also polls the NIC queues of the watched sockets.
+static int run_epoll_loop(int listen_fd, int busy_poll_us, WorkerStats& stats)
+{
+    if (!set_nonblocking(listen_fd)) {
+        return 1;
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+
+    // The listen socket is the only entry registered with a null data.ptr
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl ADD listen");
+        close(epfd);
+        return 1;
+    }
+
+    if (busy_poll_us > 0 && epoll_busy_poll(epfd, busy_poll_us) < 0) {
+        std::fprintf(stderr, "EPIOCSPARAMS: %s (needs kernel 6.9+); spinning without it\n",
+                     std::strerror(errno));
+    }
+    const int timeout_ms = busy_poll_us > 0 ? 0 : -1;
+
+    BufferPool pool(CONN_BUFFER_SIZE, BUFFER_SLAB_BLOCKS);
+    epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
         if (n < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            perror("send");
-            return false;
+            perror("epoll_wait");
+            break;
         }
+        stat_add(stats.loop_iterations, 1);
+        if (n == 0) {
+            continue;
+        }
+
+        const uint64_t start_ns = now_ns();
+        for (int i = 0; i < n; ++i) {
+            auto* state = static_cast<ClientState*>(events[i].data.ptr);
+            if (state == nullptr) {
+                accept_clients(pool, listen_fd, epfd, busy_poll_us, stats);
+                continue;
+            }
 
-        sent += static_cast<size_t>(n);
+            if ((events[i].events & EPOLLERR) || !service_client(pool, *state, stats)) {
+                close_client(pool, state, stats);
+            }
+        }
+        stats.buffer_allocs.store(pool.allocations(), std::memory_order_relaxed);
+        stats_busy_iteration(stats, start_ns, now_ns());
     }
 
+    close(epfd);
+    return 1;
+}
+
+static int run_blocking_loop(int listen_fd, int busy_poll_us, WorkerStats& stats)
+{
+    std::vector<char> buffer(CONN_BUFFER_SIZE);
+    for (;;) {
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int conn_fd = accept(listen_fd, reinterpret_cast<sockaddr*>(&cliaddr),
+                             &clilen);
+        if (conn_fd < 0) {
+            // A client that reset before being accepted is not our error
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        stat_add(stats.accepted, 1);
+        socket_nodelay(conn_fd);
+        if (busy_poll_us > 0) {
+            apply_busy_poll(conn_fd, busy_poll_us, true);
+            set_nonblocking(conn_fd);
+        }
+        handle_conn(conn_fd, buffer, stats);
+        stat_add(stats.closed, 1);
+    }
+
+    return 0;
+}
+
+#ifdef WITH_IO_URING
+// io_uring mode: multishot accept, multishot recv into a provided buffer
+// ring, and one gathering sendmsg per connection straight out of the
+// provided buffers (linked write_fixed SQEs with --fixed-buffers); the
+// echo never copies payload bytes.
+
+constexpr unsigned URING_ENTRIES = 4096;
+constexpr unsigned URING_BUF_COUNT = 4096;  // must be a power of two
+constexpr unsigned URING_BUF_SIZE = 16 * 1024;
+constexpr int URING_BUF_GROUP = 0;
+
+enum UringOp : uint64_t {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV = 2,
+    URING_OP_SEND = 3,
+};
+
+static inline uint64_t uring_tag(UringOp op, int fd)
+{
+    return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+}
+
+// A received chunk waiting to be echoed from its provided buffer
+struct UringSegment {
+    uint16_t bid;
+    uint32_t len;
+    uint32_t sent;
+};
+
+struct UringConn {
+    int fd = -1;
+    bool recv_armed = false;
+    bool closing = false;
+    unsigned inflight = 0;  // send SQEs (sendmsg, or write_fixed chain) not yet completed
+    std::vector<UringSegment> segments;
+    std::vector<iovec> send_iov;  // one sendmsg over the segments, kept until it completes
+    msghdr send_msg{};
+
+    // Frame boundary tracking, used only to validate headers
+    char header[sizeof(Msg)];
+    size_t header_bytes = 0;
+    size_t frame_remaining = 0;
+};
+
+struct UringServer {
+    io_uring ring{};
+    io_uring_buf_ring* buf_ring = nullptr;
+    char* buf_base = nullptr;
+    bool fixed_buffers = false;
+    int listen_fd = -1;
+    std::vector<UringConn*> conns;  // indexed by fd
+    std::vector<int> rearm_recv;    // connections that hit -ENOBUFS
+    WorkerStats* stats = nullptr;
+};
+
+static inline char* uring_buf_addr(UringServer& srv, uint16_t bid)
+{
+    return srv.buf_base + static_cast<size_t>(bid) * URING_BUF_SIZE;
+}
+
+static io_uring_sqe* uring_get_sqe(UringServer& srv)
+{
+    io_uring_sqe* sqe = io_uring_get_sqe(&srv.ring);
+    while (sqe == nullptr) {
+        io_uring_submit(&srv.ring);
+        sqe = io_uring_get_sqe(&srv.ring);
+    }
+    return sqe;
+}
+
+static void uring_recycle_buffer(UringServer& srv, uint16_t bid)
+{
+    io_uring_buf_ring_add(srv.buf_ring, uring_buf_addr(srv, bid), URING_BUF_SIZE,
+                          bid, io_uring_buf_ring_mask(URING_BUF_COUNT), 0);
+    io_uring_buf_ring_advance(srv.buf_ring, 1);
+}
+
+static void uring_arm_accept(UringServer& srv)
+{
+    io_uring_sqe* sqe = uring_get_sqe(srv);
+    io_uring_prep_multishot_accept(sqe, srv.listen_fd, nullptr, nullptr, 0);
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_OP_ACCEPT, srv.listen_fd));
+}
+
+static void uring_arm_recv(UringServer& srv, UringConn& conn)
+{
+    io_uring_sqe* sqe = uring_get_sqe(srv);
+    io_uring_prep_recv_multishot(sqe, conn.fd, nullptr, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    io_uring_sqe_set_data64(sqe, uring_tag(URING_OP_RECV, conn.fd));
+    conn.recv_armed = true;
+}
+
+// Echo every queued segment. Segments are separate provided buffers, so
+// one sendmsg gathers them all; registered buffers have no vectored send,
+// so with --fixed-buffers each gets a write_fixed, linked in order.
+static void uring_flush_sends(UringServer& srv, UringConn& conn)
+{
+    if (conn.inflight > 0 || conn.closing || conn.segments.empty()) {
+        return;
+    }
+
+    if (!srv.fixed_buffers) {
+        const size_t count = std::min<size_t>(conn.segments.size(), IOV_MAX);
+        conn.send_iov.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            const UringSegment& seg = conn.segments[i];
+            conn.send_iov[i].iov_base = uring_buf_addr(srv, seg.bid) + seg.sent;
+            conn.send_iov[i].iov_len = seg.len - seg.sent;
+        }
+        conn.send_msg = msghdr{};
+        conn.send_msg.msg_iov = conn.send_iov.data();
+        conn.send_msg.msg_iovlen = count;
+        io_uring_sqe* sqe = uring_get_sqe(srv);
+        io_uring_prep_sendmsg(sqe, conn.fd, &conn.send_msg, MSG_NOSIGNAL);
+        io_uring_sqe_set_data64(sqe, uring_tag(URING_OP_SEND, conn.fd));
+        conn.inflight++;
+        return;
+    }
+
+    io_uring_sqe* last = nullptr;
+    for (const UringSegment& seg : conn.segments) {
+        const char* data = uring_buf_addr(srv, seg.bid) + seg.sent;
+        const unsigned len = seg.len - seg.sent;
+        io_uring_sqe* sqe = uring_get_sqe(srv);
+        io_uring_prep_write_fixed(sqe, conn.fd, data, len, 0, 0);
+        io_uring_sqe_set_data64(sqe, uring_tag(URING_OP_SEND, conn.fd));
+        sqe->flags |= IOSQE_IO_LINK;
+        last = sqe;
+        conn.inflight++;
+    }
+    if (last != nullptr) {
+        last->flags &= ~IOSQE_IO_LINK;
+    }
+}
+
+static void uring_maybe_release(UringServer& srv, UringConn* conn)
+{
+    if (!conn->closing || conn->recv_armed || conn->inflight > 0) {
+        return;
+    }
+    for (const UringSegment& seg : conn->segments) {
+        uring_recycle_buffer(srv, seg.bid);
+    }
+    srv.conns[conn->fd] = nullptr;
+    close(conn->fd);
+    delete conn;
+    stat_add(srv.stats->closed, 1);
+}
+
+static void uring_start_close(UringServer& srv, UringConn* conn)
+{
+    if (!conn->closing) {
+        conn->closing = true;
+        // Terminates the multishot recv; its final CQE releases the conn
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    uring_maybe_release(srv, conn);
+}
+
+// Walk the frame headers inside a received chunk and stamp the server
+// timestamps into those that lie wholly inside it; the chunk goes out as
+// soon as it is scanned, so recv_ns doubles as the send time. *frames
+// counts the headers completed in this chunk.
+// Returns false on an invalid header.
+static bool uring_scan_frames(UringConn& conn, char* data, size_t len, uint64_t recv_ns,
+                              size_t* frames)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        if (conn.frame_remaining > 0) {
+            size_t skip = std::min(conn.frame_remaining, len - pos);
+            conn.frame_remaining -= skip;
+            pos += skip;
+            continue;
+        }
+
+        size_t take = std::min(sizeof(Msg) - conn.header_bytes, len - pos);
+        std::memcpy(conn.header + conn.header_bytes, data + pos, take);
+        conn.header_bytes += take;
+        pos += take;
+        if (conn.header_bytes < sizeof(Msg)) {
+            break;
+        }
+
+        Msg header;
+        std::memcpy(&header, conn.header, sizeof(header));
+        if (header.payload_size < sizeof(Msg)) {
+            std::fprintf(stderr,
+                         "client fd=%d payload_size=%" PRIu32 " below header size %zu\n",
+                         conn.fd, header.payload_size, sizeof(Msg));
+            return false;
+        }
+        if (take == sizeof(Msg)) {
+            msg_stamp_header(data + pos - sizeof(Msg), recv_ns, recv_ns);
+        }
+        conn.header_bytes = 0;
+        conn.frame_remaining = header.payload_size - sizeof(Msg);
+        (*frames)++;
+    }
     return true;
 }
 
-static bool recv_full_msg(int fd, std::vector<char>& buffer)
+static void uring_handle_accept(UringServer& srv, const io_uring_cqe* cqe)
 {
-    Msg header{};
-    if (!recv_all_bytes(fd, reinterpret_cast<char*>(&header), sizeof(header))) {
-        return false;
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_arm_accept(srv);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+            std::fprintf(stderr, "accept: %s\n", std::strerror(-cqe->res));
+        }
+        return;
+    }
+
+    stat_add(srv.stats->accepted, 1);
+    int fd = cqe->res;
+    socket_nodelay(fd);
+    if (static_cast<size_t>(fd) >= srv.conns.size()) {
+        srv.conns.resize(fd + 1, nullptr);
+    }
+    auto* conn = new UringConn;
+    conn->fd = fd;
+    srv.conns[fd] = conn;
+    uring_arm_recv(srv, *conn);
+}
+
+static void uring_handle_recv(UringServer& srv, UringConn* conn,
+                              const io_uring_cqe* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+    }
+
+    if (cqe->res == -ENOBUFS && !conn->closing) {
+        // Buffer ring ran dry; try again once sends have returned buffers
+        if (!conn->recv_armed) {
+            srv.rearm_recv.push_back(conn->fd);
+        }
+        return;
+    }
+
+    if (cqe->res <= 0) {
+        if (cqe->res < 0 && cqe->res != -ECONNRESET && !conn->closing) {
+            std::fprintf(stderr, "recv: %s\n", std::strerror(-cqe->res));
+        }
+        uring_start_close(srv, conn);
+        return;
     }
 
-    if (header.payload_size < sizeof(Msg)) {
-        std::fprintf(stderr,
-                     "invalid payload_size=%" PRIu32 " (< header size %zu)\n",
-                     header.payload_size, sizeof(Msg));
+    const uint16_t bid = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    const uint32_t len = static_cast<uint32_t>(cqe->res);
+    size_t frames = 0;
+    if (conn->closing ||
+        !uring_scan_frames(*conn, uring_buf_addr(srv, bid), len, now_ns(), &frames)) {
+        uring_recycle_buffer(srv, bid);
+        uring_start_close(srv, conn);
+        return;
+    }
+    stat_add(srv.stats->bytes, len);
+    stat_add(srv.stats->messages, frames);
+
+    conn->segments.push_back(UringSegment{bid, len, 0});
+    if (!conn->recv_armed) {
+        uring_arm_recv(srv, *conn);
+    }
+    uring_flush_sends(srv, *conn);
+}
+
+static void uring_handle_send(UringServer& srv, UringConn* conn,
+                              const io_uring_cqe* cqe)
+{
+    conn->inflight--;
+
+    // Bytes go out in segment order, whether one sendmsg covered them or
+    // a chain whose CQEs arrive in order: credit them from the first
+    // unfinished segment on.
+    if (cqe->res > 0) {
+        uint32_t bytes = static_cast<uint32_t>(cqe->res);
+        for (UringSegment& seg : conn->segments) {
+            const uint32_t take = std::min(bytes, seg.len - seg.sent);
+            seg.sent += take;
+            bytes -= take;
+            if (bytes == 0) {
+                break;
+            }
+        }
+    } else if (cqe->res == -EAGAIN) {
+        stat_add(srv.stats->send_eagain, 1);
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        if (!conn->closing && cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+            std::fprintf(stderr, "send: %s\n", std::strerror(-cqe->res));
+        }
+        conn->closing = true;
+    }
+
+    if (conn->inflight > 0) {
+        return;
+    }
+
+    size_t done = 0;
+    while (done < conn->segments.size() &&
+           conn->segments[done].sent == conn->segments[done].len) {
+        uring_recycle_buffer(srv, conn->segments[done].bid);
+        ++done;
+    }
+    conn->segments.erase(conn->segments.begin(), conn->segments.begin() + done);
+
+    if (conn->closing) {
+        uring_start_close(srv, conn);
+        return;
+    }
+    uring_flush_sends(srv, *conn);
+}
+
+static bool uring_setup(UringServer& srv, const ServerOptions& opts, int listen_fd)
+{
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    if (opts.sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 2000;  // ms before the SQ thread sleeps
+    }
+
+    int ret = io_uring_queue_init_params(URING_ENTRIES, &srv.ring, &params);
+    if (ret < 0) {
+        std::fprintf(stderr, "io_uring_queue_init_params: %s\n", std::strerror(-ret));
         return false;
     }
 
-    const size_t payload_bytes = header.payload_size - sizeof(Msg);
-    buffer.resize(header.payload_size);
-    std::memcpy(buffer.data(), &header, sizeof(header));
+    const size_t pool_bytes = static_cast<size_t>(URING_BUF_COUNT) * URING_BUF_SIZE;
+    srv.buf_base = static_cast<char*>(std::aligned_alloc(4096, pool_bytes));
+    if (srv.buf_base == nullptr) {
+        perror("aligned_alloc");
+        return false;
+    }
 
-    if (payload_bytes > 0 &&
-        !recv_all_bytes(fd, buffer.data() + sizeof(Msg), payload_bytes)) {
+    srv.buf_ring = io_uring_setup_buf_ring(&srv.ring, URING_BUF_COUNT,
+                                           URING_BUF_GROUP, 0, &ret);
+    if (srv.buf_ring == nullptr) {
+        std::fprintf(stderr, "io_uring_setup_buf_ring: %s\n", std::strerror(-ret));
         return false;
     }
+    for (unsigned i = 0; i < URING_BUF_COUNT; ++i) {
+        io_uring_buf_ring_add(srv.buf_ring, uring_buf_addr(srv, static_cast<uint16_t>(i)),
+                              URING_BUF_SIZE, static_cast<unsigned short>(i),
+                              io_uring_buf_ring_mask(URING_BUF_COUNT), static_cast<int>(i));
+    }
+    io_uring_buf_ring_advance(srv.buf_ring, URING_BUF_COUNT);
 
+    if (opts.fixed_buffers) {
+        // One registered region covering the whole pool, so sends can go out
+        // as WRITE_FIXED without pinning pages per request.
+        iovec iov{srv.buf_base, pool_bytes};
+        ret = io_uring_register_buffers(&srv.ring, &iov, 1);
+        if (ret < 0) {
+            std::fprintf(stderr, "io_uring_register_buffers: %s\n", std::strerror(-ret));
+            return false;
+        }
+        srv.fixed_buffers = true;
+    }
+
+    srv.listen_fd = listen_fd;
     return true;
 }
 
-static bool send_full_msg(int fd, const std::vector<char>& buffer)
+static int run_uring_loop(const ServerOptions& opts, int listen_fd, WorkerStats& stats)
 {
-    return send_all_bytes(fd, buffer.data(), buffer.size());
-}
+    UringServer srv;
+    srv.stats = &stats;
+    if (!uring_setup(srv, opts, listen_fd)) {
+        return 1;
+    }
+
+    uring_arm_accept(srv);
 
-static void handle_conn(int fd) {
-    std::vector<char> buffer;
     for (;;) {
-        if (!recv_full_msg(fd, buffer))
-            break;
-        if (!send_full_msg(fd, buffer))
+        int ret = io_uring_submit_and_wait(&srv.ring, 1);
+        if (ret < 0 && ret != -EINTR) {
+            std::fprintf(stderr, "io_uring_submit_and_wait: %s\n", std::strerror(-ret));
             break;
+        }
+        stat_add(stats.loop_iterations, 1);
+        const uint64_t start_ns = now_ns();
+
+        io_uring_cqe* cqe;
+        unsigned head;
+        unsigned count = 0;
+        io_uring_for_each_cqe(&srv.ring, head, cqe) {
+            ++count;
+            const uint64_t tag = io_uring_cqe_get_data64(cqe);
+            const auto op = static_cast<UringOp>(tag >> 32);
+            const int fd = static_cast<int>(tag & 0xffffffffu);
+
+            if (op == URING_OP_ACCEPT) {
+                uring_handle_accept(srv, cqe);
+                continue;
+            }
+
+            UringConn* conn = (static_cast<size_t>(fd) < srv.conns.size())
+                                  ? srv.conns[fd] : nullptr;
+            if (conn == nullptr) {
+                continue;
+            }
+            if (op == URING_OP_RECV) {
+                uring_handle_recv(srv, conn, cqe);
+            } else {
+                uring_handle_send(srv, conn, cqe);
+            }
+        }
+        io_uring_cq_advance(&srv.ring, count);
+
+        for (int fd : srv.rearm_recv) {
+            UringConn* conn = srv.conns[fd];
+            if (conn == nullptr) {
+                continue;
+            }
+            if (conn->closing) {
+                uring_maybe_release(srv, conn);
+            } else if (!conn->recv_armed) {
+                uring_arm_recv(srv, *conn);
+            }
+        }
+        srv.rearm_recv.clear();
+        if (count > 0) {
+            stats_busy_iteration(stats, start_ns, now_ns());
+        }
     }
 
-    close(fd);
+    io_uring_queue_exit(&srv.ring);
+    return 1;
 }
+#endif  // WITH_IO_URING
 
-int main() {
+// UDP mode: one datagram is one frame. recvmmsg pulls up to UDP_BATCH
+// datagrams per syscall (blocking for the first only) and sendmmsg echoes
+// the whole batch back to the senders in place. Datagrams that are
+// truncated or whose payload_size disagrees with their length are dropped.
+static int run_udp_loop(int fd, int busy_poll_us, WorkerStats& stats)
+{
+    // Busy-poll mode spins on MSG_DONTWAIT instead of sleeping in recvmmsg
+    int recv_flags = MSG_WAITFORONE;
+    if (busy_poll_us > 0) {
+        apply_busy_poll(fd, busy_poll_us, false);
+        recv_flags |= MSG_DONTWAIT;
+    }
+
+    std::vector<char> buffers(UDP_BATCH * UDP_MAX_DATAGRAM);
+    mmsghdr rx[UDP_BATCH] = {};
+    mmsghdr tx[UDP_BATCH] = {};
+    iovec rx_iov[UDP_BATCH];
+    iovec tx_iov[UDP_BATCH];
+    sockaddr_in peers[UDP_BATCH];
+    for (int i = 0; i < UDP_BATCH; ++i) {
+        rx_iov[i].iov_base = buffers.data() + i * UDP_MAX_DATAGRAM;
+        rx_iov[i].iov_len = UDP_MAX_DATAGRAM;
+        rx[i].msg_hdr.msg_iov = &rx_iov[i];
+        rx[i].msg_hdr.msg_iovlen = 1;
+        rx[i].msg_hdr.msg_name = &peers[i];
+    }
+
+    for (;;) {
+        for (int i = 0; i < UDP_BATCH; ++i) {
+            rx[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        }
+        int n = recvmmsg(fd, rx, UDP_BATCH, recv_flags, nullptr);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stat_add(stats.loop_iterations, 1);
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            perror("recvmmsg");
+            return 1;
+        }
+        const uint64_t recv_ns = now_ns();
+        stat_add(stats.loop_iterations, 1);
+
+        int out = 0;
+        for (int i = 0; i < n; ++i) {
+            const size_t len = rx[i].msg_len;
+            char* data = static_cast<char*>(rx_iov[i].iov_base);
+            Msg header;
+            if ((rx[i].msg_hdr.msg_flags & MSG_TRUNC) || len < sizeof(Msg))
+                continue;
+            std::memcpy(&header, data, sizeof(header));
+            if (header.payload_size != len)
+                continue;
+
+            tx_iov[out].iov_base = data;
+            tx_iov[out].iov_len = len;
+            tx[out].msg_hdr.msg_iov = &tx_iov[out];
+            tx[out].msg_hdr.msg_iovlen = 1;
+            tx[out].msg_hdr.msg_name = &peers[i];
+            tx[out].msg_hdr.msg_namelen = rx[i].msg_hdr.msg_namelen;
+            out++;
+            stat_add(stats.bytes, len);
+        }
+        stat_add(stats.messages, out);
+
+        const uint64_t send_ns = now_ns();
+        for (int i = 0; i < out; ++i) {
+            msg_stamp_header(static_cast<char*>(tx_iov[i].iov_base), recv_ns, send_ns);
+        }
+
+        // sendmmsg stops at the first datagram it cannot send; skip that
+        // one (UDP may drop) and carry on with the rest
+        int sent = 0;
+        while (sent < out) {
+            int m = sendmmsg(fd, tx + sent, out - sent, 0);
+            if (m < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    stat_add(stats.send_eagain, 1);
+                else
+                    perror("sendmmsg");
+                m = 1;
+            }
+            sent += m;
+        }
+        stats_busy_iteration(stats, recv_ns, now_ns());
+    }
+}
+
+static int create_udp_socket(int port, bool reuseport)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Bursts of datagrams are dropped, not queued, once the buffer is full
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &UDP_SOCKET_BUFFER, sizeof(UDP_SOCKET_BUFFER));
+
+    const int yes = 1;
+    if (reuseport &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(fd);
+        return -1;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int create_listen_socket(int port, bool reuseport)
+{
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) {
         perror("socket");
-        return 1;
+        return -1;
     }
 
     const int yes = 1;
     setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (reuseport &&
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(listen_fd);
+        return -1;
+    }
 
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port = htons(LISTEN_PORT);
+    addr.sin_port = htons(port);
 
     if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
         perror("bind");
-        return 1;
+        close(listen_fd);
+        return -1;
     }
 
     if (listen(listen_fd, BACKLOG) < 0) {
         perror("listen");
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+static int run_server_loop(const ServerOptions& opts, int listen_fd, WorkerStats& stats)
+{
+    switch (opts.mode) {
+    case ServerMode::Epoll:
+        return run_epoll_loop(listen_fd, opts.busy_poll_us, stats);
+    case ServerMode::Uring:
+#ifdef WITH_IO_URING
+        return run_uring_loop(opts, listen_fd, stats);
+#else
         return 1;
+#endif
+    case ServerMode::Udp:
+        return run_udp_loop(listen_fd, opts.busy_poll_us, stats);
+    case ServerMode::Blocking:
+        break;
     }
+    return run_blocking_loop(listen_fd, opts.busy_poll_us, stats);
+}
 
-    printf("Kernel echo server listening on port %d\n", LISTEN_PORT);
-    printf("Minimum total message size: %zu bytes\n", sizeof(Msg));
+// Each worker owns a SO_REUSEPORT listen socket, so the kernel spreads new
+// connections across workers and no state is shared between them.
+static void worker_main(const ServerOptions& opts, int worker_id, int listen_fd,
+                        WorkerStats* stats)
+{
+    if (!opts.cpus.empty()) {
+        int cpu = opts.cpus[worker_id % opts.cpus.size()];
+        if (pin_current_thread(cpu) == 0) {
+            printf("worker %d pinned to cpu %d\n", worker_id, cpu);
+        }
+    }
+
+    run_server_loop(opts, listen_fd, *stats);
+    close(listen_fd);
+}
 
+// --perf: the first SIGUSR1 starts counting, the next one stops it and
+// prints the counts per message served by all workers, and so on. The counters are opened
+// with inherit before any worker exists, so they cover all of them, and
+// SIGUSR1 is blocked everywhere and taken here with sigwait(), so worker
+// loops are never interrupted. io_uring's SQPOLL thread belongs to the
+// kernel and is not counted.
+static uint64_t total_messages(const StatsRegion* stats)
+{
+    uint64_t messages = 0;
+    for (uint32_t i = 0; i < stats->workers; ++i) {
+        messages += stats->slots[i].messages.load(std::memory_order_relaxed);
+    }
+    return messages;
+}
+
+static void run_perf_control(PerfCounters* perf, const StatsRegion* stats)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    bool counting = false;
+    uint64_t start_ns = 0;
+    uint64_t start_messages = 0;
     for (;;) {
-        struct sockaddr_in cliaddr;
-        socklen_t clilen = sizeof(cliaddr);
-        int conn_fd = accept(listen_fd, reinterpret_cast<sockaddr*>(&cliaddr),
-                             &clilen);
-        if (conn_fd < 0) {
-            if (errno == EINTR)
-                continue;
-            perror("accept");
+        int sig = 0;
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        const uint64_t now = now_ns();
+        const uint64_t messages = total_messages(stats);
+        if (!counting) {
+            perf->start();
+            start_ns = now;
+            start_messages = messages;
+            printf("[perf] counting started\n");
+        } else {
+            perf->stop();
+            const uint64_t served = messages - start_messages;
+            char line[512];
+            format_perf_sample(line, sizeof(line), perf->read(), served);
+            printf("[perf] %.3f s, %" PRIu64 " msgs (%s): %s\n", (now - start_ns) / 1e9,
+                   served, perf->scope(), line);
+        }
+        std::fflush(stdout);
+        counting = !counting;
+    }
+}
+
+static const char* mode_name(ServerMode mode)
+{
+    switch (mode) {
+    case ServerMode::Blocking:
+        return "blocking";
+    case ServerMode::Epoll:
+        return "epoll";
+    case ServerMode::Uring:
+        return "uring";
+    case ServerMode::Udp:
+        return "udp";
+    }
+    return "unknown";
+}
+
+static void print_usage(const char* prog)
+{
+    std::fprintf(stderr,
+                 "Usage: %s [--mode blocking|epoll|uring|udp] [--port N] [--threads N] "
+                 "[--cpus LIST] [--sqpoll] [--fixed-buffers] [--perf] [--busy-poll[=US]]\n"
+                 "  --mode blocking  serve one connection at a time (default)\n"
+                 "  --mode epoll     edge-triggered epoll over all connections\n"
+                 "  --mode uring     io_uring multishot accept/recv, sendmsg gather\n"
+                 "  --mode udp       UDP datagram echo, recvmmsg/sendmmsg batches\n"
+                 "  --threads N      N workers, each with its own SO_REUSEPORT "
+                 "listen (or UDP) socket\n"
+                 "  --cpus LIST      pin workers to CPUs, e.g. 0-3 or 1,3,5\n"
+                 "  --sqpoll         io_uring: submit through a kernel SQ thread\n"
+                 "  --fixed-buffers  io_uring: send from registered buffers (linked write_fixed)\n"
+                 "  --busy-poll[=US] spin on non-blocking sockets with SO_BUSY_POLL=US "
+                 "(default %d),\n"
+                 "                   SO_PREFER_BUSY_POLL, epoll busy polling, TCP_NODELAY "
+                 "and TCP_QUICKACK\n"
+                 "                   (blocking, epoll and udp modes)\n"
+                 "  --perf           kill -USR1 starts/stops hardware counters "
+                 "(cycles, IPC, misses)\n",
+                 prog, BUSY_POLL_DEFAULT_US);
+}
+
+static bool parse_options(int argc, char* argv[], ServerOptions* opts)
+{
+    static const option long_options[] = {
+        {"mode", required_argument, nullptr, 'm'},
+        {"port", required_argument, nullptr, 'p'},
+        {"threads", required_argument, nullptr, 't'},
+        {"cpus", required_argument, nullptr, 'c'},
+        {"sqpoll", no_argument, nullptr, 'S'},
+        {"fixed-buffers", no_argument, nullptr, 'F'},
+        {"perf", no_argument, nullptr, 'P'},
+        {"busy-poll", optional_argument, nullptr, 'B'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "m:p:t:c:h", long_options, nullptr)) != -1) {
+        switch (c) {
+        case 'm':
+            if (std::strcmp(optarg, "blocking") == 0) {
+                opts->mode = ServerMode::Blocking;
+            } else if (std::strcmp(optarg, "epoll") == 0) {
+                opts->mode = ServerMode::Epoll;
+            } else if (std::strcmp(optarg, "udp") == 0) {
+                opts->mode = ServerMode::Udp;
+            } else if (std::strcmp(optarg, "uring") == 0) {
+#ifdef WITH_IO_URING
+                opts->mode = ServerMode::Uring;
+#else
+                std::fprintf(stderr, "uring mode needs a build with -DWITH_IO_URING -luring\n");
+                return false;
+#endif
+            } else {
+                std::fprintf(stderr, "unknown mode: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'p':
+            opts->port = std::atoi(optarg);
+            if (opts->port <= 0 || opts->port > 65535) {
+                std::fprintf(stderr, "invalid port: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 't':
+            opts->threads = std::atoi(optarg);
+            if (opts->threads <= 0 || opts->threads > STATS_MAX_WORKERS) {
+                std::fprintf(stderr, "invalid thread count: %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'c': {
+            opts->cpus.resize(CPU_SETSIZE);
+            int count = parse_cpu_list(optarg, opts->cpus.data(), CPU_SETSIZE);
+            if (count < 0) {
+                std::fprintf(stderr, "invalid cpu list: %s\n", optarg);
+                return false;
+            }
+            opts->cpus.resize(count);
             break;
         }
+        case 'S':
+            opts->sqpoll = true;
+            break;
+        case 'F':
+            opts->fixed_buffers = true;
+            break;
+        case 'P':
+            opts->perf = true;
+            break;
+        case 'B':
+            opts->busy_poll_us = optarg ? std::atoi(optarg) : BUSY_POLL_DEFAULT_US;
+            if (opts->busy_poll_us <= 0) {
+                std::fprintf(stderr, "invalid busy-poll time: %s\n", optarg);
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
 
-        handle_conn(conn_fd);
+    if (optind < argc) {
+        std::fprintf(stderr, "unexpected argument: %s\n", argv[optind]);
+        return false;
+    }
+    if (opts->busy_poll_us > 0 && opts->mode == ServerMode::Uring) {
+        std::fprintf(stderr, "--busy-poll does not apply to uring mode; use --sqpoll\n");
+        return false;
     }
+    return true;
+}
 
-    close(listen_fd);
+int main(int argc, char* argv[]) {
+    ServerOptions opts;
+    if (!parse_options(argc, argv, &opts)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    clock_init();
+    const bool reuseport = opts.threads > 1;
+
+    // Open every listen socket up front so a bind failure aborts startup
+    std::vector<int> listen_fds;
+    for (int i = 0; i < opts.threads; ++i) {
+        int listen_fd = opts.mode == ServerMode::Udp
+                            ? create_udp_socket(opts.port, reuseport)
+                            : create_listen_socket(opts.port, reuseport);
+        if (listen_fd < 0) {
+            for (int fd : listen_fds) {
+                close(fd);
+            }
+            return 1;
+        }
+        listen_fds.push_back(listen_fd);
+    }
+
+    printf("Kernel echo server listening on port %d (mode=%s, threads=%d%s)\n",
+           opts.port, mode_name(opts.mode), opts.threads,
+           opts.busy_poll_us > 0 ? ", busy-poll" : "");
+    printf("Minimum total message size: %zu bytes\n", sizeof(Msg));
+    printf("Timestamp clock: %s\n", clock_source_name());
+
+    // One slot per worker; slots left over from a run with more workers
+    // are released so readers do not report them
+    const std::string stats_name = "/kernel_echo_stats_" + std::to_string(opts.port);
+    StatsRegion* stats = stats_map(stats_name.c_str(), true, opts.threads);
+    if (stats == nullptr) {
+        return 1;
+    }
+    for (int i = 0; i < STATS_MAX_WORKERS; ++i) {
+        if (i < opts.threads) {
+            stats_reset(stats->slots[i], now_ns());
+        } else {
+            stats->slots[i].pid.store(0, std::memory_order_relaxed);
+        }
+    }
+    printf("Live stats: ./stats_reader %s\n", stats_name.c_str());
+
+    PerfCounters perf;
+    if (opts.perf) {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+        if (perf.open(true) == 0) {
+            std::fprintf(stderr, "perf_event_open failed: %s\n", std::strerror(errno));
+            return 1;
+        }
+        std::thread(run_perf_control, &perf, stats).detach();
+        printf("Perf counters ready: kill -USR1 %d to start and stop\n",
+               static_cast<int>(getpid()));
+    }
+    std::fflush(stdout);
+
+    if (opts.threads == 1 && opts.cpus.empty()) {
+        int ret = run_server_loop(opts, listen_fds[0], stats->slots[0]);
+        close(listen_fds[0]);
+        return ret;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(opts.threads);
+    for (int i = 0; i < opts.threads; ++i) {
+        workers.emplace_back(worker_main, std::cref(opts), i, listen_fds[i],
+                             &stats->slots[i]);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
     return 0;
 }
@@ -0,0 +1,137 @@
+// server_stats.h
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Live counters of a running server, published in a POSIX shared memory
+// segment that stats_reader (or proc 0 of the F-Stack server) polls. Every
+// worker thread or process owns one WorkerStats slot on its own cache
+// lines and is its only writer, so updates are relaxed load+store pairs
+// with no locked instructions or sharing; readers may see values from
+// slightly different instants.
+//
+// Loop iterations are counted every time round; only those that handled
+// at least one event are timed (two clock reads), so an idle poll loop
+// pays one store per iteration.
+constexpr uint32_t STATS_MAGIC = 0x53544154;  // "STAT"
+constexpr uint32_t STATS_VERSION = 1;
+constexpr int STATS_MAX_WORKERS = 64;
+constexpr int STATS_LOOP_BUCKETS = 32;  // bucket b: busy iterations of [2^b, 2^(b+1)) ns
+
+struct alignas(64) WorkerStats {
+    std::atomic<uint64_t> pid;           // 0 = slot never used
+    std::atomic<uint64_t> heartbeat_ns;  // now_ns() of the last busy iteration or report
+    std::atomic<uint64_t> messages;
+    std::atomic<uint64_t> bytes;         // received
+    std::atomic<uint64_t> accepted;
+    std::atomic<uint64_t> closed;
+    std::atomic<uint64_t> recv_eagain;
+    std::atomic<uint64_t> send_eagain;
+    std::atomic<uint64_t> buffer_allocs;    // heap allocations by the buffer pool
+    std::atomic<uint64_t> loop_iterations;  // including idle ones
+    std::atomic<uint64_t> busy_iterations;
+    std::atomic<uint64_t> busy_ns;
+    std::atomic<uint64_t> loop_hist[STATS_LOOP_BUCKETS];
+};
+
+struct StatsRegion {
+    alignas(64) uint32_t magic;
+    uint32_t version;
+    uint32_t workers;  // slots in use, or STATS_MAX_WORKERS if not known up front
+    WorkerStats slots[STATS_MAX_WORKERS];
+};
+
+static inline void stat_add(std::atomic<uint64_t>& counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+}
+
+static inline int stats_loop_bucket(uint64_t ns)
+{
+    const int b = 63 - __builtin_clzll(ns | 1);
+    return b < STATS_LOOP_BUCKETS ? b : STATS_LOOP_BUCKETS - 1;
+}
+
+// A timed iteration that handled events, from start_ns to end_ns
+static inline void stats_busy_iteration(WorkerStats& s, uint64_t start_ns, uint64_t end_ns)
+{
+    const uint64_t ns = end_ns - start_ns;
+    stat_add(s.busy_iterations, 1);
+    stat_add(s.busy_ns, ns);
+    stat_add(s.loop_hist[stats_loop_bucket(ns)], 1);
+    s.heartbeat_ns.store(end_ns, std::memory_order_relaxed);
+}
+
+// Clear a slot and claim it for this process
+static inline void stats_reset(WorkerStats& s, uint64_t now)
+{
+    s.messages.store(0, std::memory_order_relaxed);
+    s.bytes.store(0, std::memory_order_relaxed);
+    s.accepted.store(0, std::memory_order_relaxed);
+    s.closed.store(0, std::memory_order_relaxed);
+    s.recv_eagain.store(0, std::memory_order_relaxed);
+    s.send_eagain.store(0, std::memory_order_relaxed);
+    s.buffer_allocs.store(0, std::memory_order_relaxed);
+    s.loop_iterations.store(0, std::memory_order_relaxed);
+    s.busy_iterations.store(0, std::memory_order_relaxed);
+    s.busy_ns.store(0, std::memory_order_relaxed);
+    for (auto& bucket : s.loop_hist) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    s.heartbeat_ns.store(now, std::memory_order_relaxed);
+    s.pid.store(static_cast<uint64_t>(getpid()), std::memory_order_relaxed);
+}
+
+// Writers create the segment if needed (several F-Stack processes may race
+// to do so; they all write the same header). Readers map it read-only.
+static inline StatsRegion* stats_map(const char* name, bool writer, uint32_t workers)
+{
+    int fd = shm_open(name, writer ? (O_CREAT | O_RDWR) : O_RDONLY, 0644);
+    if (fd < 0) {
+        perror("shm_open");
+        return nullptr;
+    }
+    if (writer && ftruncate(fd, sizeof(StatsRegion)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return nullptr;
+    }
+    // A reader may find a foreign segment, or one a writer has created but
+    // not yet sized; touching it past the end would raise SIGBUS
+    struct stat st;
+    if (!writer && (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(StatsRegion)))) {
+        fprintf(stderr, "%s is not a stats segment (too small)\n", name);
+        close(fd);
+        return nullptr;
+    }
+    void* mem = mmap(nullptr, sizeof(StatsRegion), writer ? (PROT_READ | PROT_WRITE) : PROT_READ,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+
+    auto* region = static_cast<StatsRegion*>(mem);
+    if (writer) {
+        region->magic = STATS_MAGIC;
+        region->version = STATS_VERSION;
+        region->workers = workers;
+    } else if (region->magic != STATS_MAGIC || region->version != STATS_VERSION) {
+        fprintf(stderr, "%s is not a version %u stats segment\n", name, STATS_VERSION);
+        munmap(mem, sizeof(StatsRegion));
+        return nullptr;
+    }
+    return region;
+}
+
+#endif // SERVER_STATS_H
@@ -0,0 +1,834 @@
+// server_xdp.cpp
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "common.h"
+#include "perf_counters.h"
+#include "server_stats.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+// AF_XDP UDP echo: the middle point between server_kernel.cpp and the
+// kernel-bypass servers. A small XDP program steers IPv4/UDP datagrams for
+// the echo port on one NIC queue into an AF_XDP socket and passes
+// everything else (ARP, ssh, ...) to the kernel stack as usual. Frames
+// live in a UMEM shared with the kernel: a request frame comes off the RX
+// ring, has its MAC/IP/port swapped and server timestamps written in
+// place, and goes back on the TX ring as its own reply; the completion
+// ring then hands it to the fill ring for the next receive. Rings are
+// drained in batches, and nothing is copied in zero-copy mode.
+//
+// Everything is set up through the kernel UAPI (if_xdp.h, bpf(2)) rather
+// than libxdp/libbpf, so there is nothing to install; the XDP program is
+// twenty-odd instructions and attached through a BPF link (Linux 5.9+),
+// which detaches it again when the process exits.
+
+constexpr int LISTEN_PORT = 8080;
+constexpr uint32_t NUM_FRAMES = 4096;
+constexpr uint32_t FRAME_SIZE = 4096;
+constexpr uint32_t FILL_RING_SIZE = NUM_FRAMES;  // every frame fits, so refills never fail
+constexpr uint32_t COMP_RING_SIZE = NUM_FRAMES;
+constexpr uint32_t RX_RING_SIZE = 2048;
+constexpr uint32_t TX_RING_SIZE = 2048;
+constexpr uint32_t BATCH_SIZE = 64;
+constexpr int IDLE_POLL_MS = 100;
+
+constexpr const char* STATS_SHM_NAME = "/xdp_echo_stats";
+constexpr uint64_t STATS_REPORT_NS = 1000000000ull;
+
+enum class XdpCopyMode {
+    Auto,      // zero-copy if the driver supports it, else copy
+    ZeroCopy,
+    Copy,
+};
+
+struct ServerOptions {
+    const char* dev = nullptr;
+    uint32_t queue = 0;
+    uint16_t port = LISTEN_PORT;
+    XdpCopyMode copy_mode = XdpCopyMode::Auto;
+    bool skb_mode = false;   // generic XDP, for drivers without native support
+    int busy_poll_us = 0;    // > 0: spin on the rings, see socket_busy_poll()
+    bool perf = false;
+};
+
+// One mmapped ring. Producer rings (fill, TX) are written by us and
+// consumer rings (RX, completion) by the kernel; the cached indices keep
+// the shared ones from being touched more than once per batch.
+struct XskRing {
+    uint32_t* producer = nullptr;
+    uint32_t* consumer = nullptr;
+    uint32_t* flags = nullptr;
+    void* descs = nullptr;
+    uint32_t mask = 0;
+    uint32_t size = 0;
+    uint32_t cached_prod = 0;
+    uint32_t cached_cons = 0;
+    void* map = MAP_FAILED;
+    size_t map_len = 0;
+};
+
+struct XskSocket {
+    int fd = -1;
+    char* umem = nullptr;
+    size_t umem_len = 0;
+    XskRing fill;
+    XskRing comp;
+    XskRing rx;
+    XskRing tx;
+    bool zero_copy = false;
+};
+
+struct ServerContext {
+    ServerOptions opts;
+    XskSocket xsk;
+    WorkerStats* stats = nullptr;
+    PerfCounters perf;
+    bool perf_counting = false;
+    uint64_t perf_start_ns = 0;
+    uint64_t perf_start_messages = 0;
+    uint64_t next_report_ns = 0;
+    uint64_t last_messages = 0;
+};
+
+static volatile sig_atomic_t g_quit = 0;
+static volatile sig_atomic_t g_perf_toggle = 0;
+
+static void on_signal(int signum)
+{
+    if (signum == SIGUSR1) {
+        g_perf_toggle = 1;
+    } else {
+        g_quit = 1;
+    }
+}
+
+// --- rings -----------------------------------------------------------------
+
+// Free slots in a producer ring, at most n
+static uint32_t ring_prod_free(XskRing& r, uint32_t n)
+{
+    uint32_t free = r.size - (r.cached_prod - r.cached_cons);
+    if (free < n) {
+        r.cached_cons = __atomic_load_n(r.consumer, __ATOMIC_ACQUIRE);
+        free = r.size - (r.cached_prod - r.cached_cons);
+    }
+    return free < n ? free : n;
+}
+
+static void ring_prod_submit(XskRing& r, uint32_t n)
+{
+    r.cached_prod += n;
+    __atomic_store_n(r.producer, r.cached_prod, __ATOMIC_RELEASE);
+}
+
+// Filled entries in a consumer ring, at most n
+static uint32_t ring_cons_peek(XskRing& r, uint32_t n)
+{
+    uint32_t ready = r.cached_prod - r.cached_cons;
+    if (ready < n) {
+        r.cached_prod = __atomic_load_n(r.producer, __ATOMIC_ACQUIRE);
+        ready = r.cached_prod - r.cached_cons;
+    }
+    return ready < n ? ready : n;
+}
+
+static void ring_cons_release(XskRing& r, uint32_t n)
+{
+    r.cached_cons += n;
+    __atomic_store_n(r.consumer, r.cached_cons, __ATOMIC_RELEASE);
+}
+
+static uint64_t* addr_slot(XskRing& r, uint32_t index)
+{
+    return &static_cast<uint64_t*>(r.descs)[index & r.mask];
+}
+
+static xdp_desc* desc_slot(XskRing& r, uint32_t index)
+{
+    return &static_cast<xdp_desc*>(r.descs)[index & r.mask];
+}
+
+static bool ring_needs_wakeup(const XskRing& r)
+{
+    return *r.flags & XDP_RING_NEED_WAKEUP;
+}
+
+static bool map_ring(int fd, const xdp_ring_offset& off, uint64_t pgoff, uint32_t size,
+                     size_t desc_size, XskRing* r)
+{
+    r->map_len = off.desc + size * desc_size;
+    r->map = mmap(nullptr, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  fd, static_cast<off_t>(pgoff));
+    if (r->map == MAP_FAILED) {
+        perror("mmap xsk ring");
+        return false;
+    }
+    char* base = static_cast<char*>(r->map);
+    r->producer = reinterpret_cast<uint32_t*>(base + off.producer);
+    r->consumer = reinterpret_cast<uint32_t*>(base + off.consumer);
+    r->flags = reinterpret_cast<uint32_t*>(base + off.flags);
+    r->descs = base + off.desc;
+    r->size = size;
+    r->mask = size - 1;
+    r->cached_prod = *r->producer;
+    r->cached_cons = *r->consumer;
+    return true;
+}
+
+// --- socket ----------------------------------------------------------------
+
+static void xsk_close(XskSocket& xsk)
+{
+    for (XskRing* r : {&xsk.fill, &xsk.comp, &xsk.rx, &xsk.tx}) {
+        if (r->map != MAP_FAILED) {
+            munmap(r->map, r->map_len);
+        }
+        *r = XskRing{};
+    }
+    if (xsk.fd >= 0) {
+        close(xsk.fd);
+        xsk.fd = -1;
+    }
+    if (xsk.umem != nullptr) {
+        munmap(xsk.umem, xsk.umem_len);
+        xsk.umem = nullptr;
+    }
+}
+
+// Create the socket, register the UMEM, map all four rings and bind to
+// ifindex/queue with bind_flags (XDP_ZEROCOPY or XDP_COPY). On failure
+// errno is that of the failing call and nothing is left open.
+static bool xsk_open(const ServerOptions& opts, unsigned ifindex, uint16_t bind_flags,
+                     XskSocket* xsk)
+{
+    auto fail = [xsk](const char* what) {
+        const int saved = errno;
+        if (what != nullptr) {
+            perror(what);
+        }
+        xsk_close(*xsk);
+        errno = saved;
+        return false;
+    };
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk->fd < 0) {
+        return fail("socket AF_XDP");
+    }
+    xsk->umem_len = static_cast<size_t>(NUM_FRAMES) * FRAME_SIZE;
+    void* umem = mmap(nullptr, xsk->umem_len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (umem == MAP_FAILED) {
+        return fail("mmap umem");
+    }
+    xsk->umem = static_cast<char*>(umem);
+
+    xdp_umem_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.addr = reinterpret_cast<uint64_t>(xsk->umem);
+    reg.len = xsk->umem_len;
+    reg.chunk_size = FRAME_SIZE;
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0) {
+        return fail("XDP_UMEM_REG");
+    }
+    const uint32_t sizes[][2] = {
+        {XDP_UMEM_FILL_RING, FILL_RING_SIZE},
+        {XDP_UMEM_COMPLETION_RING, COMP_RING_SIZE},
+        {XDP_RX_RING, RX_RING_SIZE},
+        {XDP_TX_RING, TX_RING_SIZE},
+    };
+    for (const auto& s : sizes) {
+        if (setsockopt(xsk->fd, SOL_XDP, static_cast<int>(s[0]), &s[1], sizeof(s[1])) < 0) {
+            return fail("setsockopt xsk ring size");
+        }
+    }
+
+    xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+        return fail("XDP_MMAP_OFFSETS");
+    }
+    if (!map_ring(xsk->fd, off.fr, XDP_UMEM_PGOFF_FILL_RING, FILL_RING_SIZE,
+                  sizeof(uint64_t), &xsk->fill) ||
+        !map_ring(xsk->fd, off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, COMP_RING_SIZE,
+                  sizeof(uint64_t), &xsk->comp) ||
+        !map_ring(xsk->fd, off.rx, XDP_PGOFF_RX_RING, RX_RING_SIZE,
+                  sizeof(xdp_desc), &xsk->rx) ||
+        !map_ring(xsk->fd, off.tx, XDP_PGOFF_TX_RING, TX_RING_SIZE,
+                  sizeof(xdp_desc), &xsk->tx)) {
+        return fail(nullptr);
+    }
+
+    // Replies reuse their request's frame, so every frame starts on the
+    // fill ring and there is no free list to manage
+    for (uint32_t i = 0; i < NUM_FRAMES; ++i) {
+        *addr_slot(xsk->fill, xsk->fill.cached_prod + i) = static_cast<uint64_t>(i) * FRAME_SIZE;
+    }
+    ring_prod_submit(xsk->fill, NUM_FRAMES);
+
+    sockaddr_xdp sxdp;
+    std::memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = opts.queue;
+    sxdp.sxdp_flags = bind_flags | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, reinterpret_cast<sockaddr*>(&sxdp), sizeof(sxdp)) < 0) {
+        return fail(nullptr);  // the caller may retry in copy mode
+    }
+    xsk->zero_copy = (bind_flags & XDP_ZEROCOPY) != 0;
+    return true;
+}
+
+// --- XDP program -----------------------------------------------------------
+
+static long bpf(int cmd, bpf_attr* attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+static bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm)
+{
+    bpf_insn i;
+    std::memset(&i, 0, sizeof(i));
+    i.code = code;
+    i.dst_reg = dst & 0xf;
+    i.src_reg = src & 0xf;
+    i.off = off;
+    i.imm = imm;
+    return i;
+}
+
+static int create_xsk_map(uint32_t entries)
+{
+    bpf_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = entries;
+    std::strncpy(attr.map_name, "xsks_map", sizeof(attr.map_name) - 1);
+    return static_cast<int>(bpf(BPF_MAP_CREATE, &attr));
+}
+
+static bool update_xsk_map(int map_fd, uint32_t queue, int xsk_fd)
+{
+    uint32_t value = static_cast<uint32_t>(xsk_fd);
+    bpf_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.map_fd = static_cast<uint32_t>(map_fd);
+    attr.key = reinterpret_cast<uint64_t>(&queue);
+    attr.value = reinterpret_cast<uint64_t>(&value);
+    return bpf(BPF_MAP_UPDATE_ELEM, &attr) == 0;
+}
+
+// The equivalent of
+//   if (eth->h_proto == htons(ETH_P_IP) && ip->ihl == 5 && ip->version == 4 &&
+//       ip->protocol == IPPROTO_UDP && !(ip->frag_off & htons(IP_MF | IP_OFFSET)) &&
+//       udp->dest == htons(port))
+//       return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+//   return XDP_PASS;
+// IP options and fragments go to the kernel, which reassembles them.
+static int load_xdp_program(int map_fd, uint16_t port)
+{
+    constexpr uint8_t R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4, R5 = 5, R6 = 6;
+    constexpr int16_t TO_PASS = 0x7fff;  // patched below
+    const int32_t l4_end = sizeof(ethhdr) + sizeof(iphdr) + sizeof(udphdr);
+    const int32_t ip_off = sizeof(ethhdr);
+    const int32_t udp_off = sizeof(ethhdr) + sizeof(iphdr);
+
+    std::vector<bpf_insn> prog = {
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, R6, R1, 0, 0),
+        insn(BPF_LDX | BPF_MEM | BPF_W, R2, R1, offsetof(xdp_md, data), 0),
+        insn(BPF_LDX | BPF_MEM | BPF_W, R3, R1, offsetof(xdp_md, data_end), 0),
+        insn(BPF_ALU64 | BPF_MOV | BPF_X, R4, R2, 0, 0),
+        insn(BPF_ALU64 | BPF_ADD | BPF_K, R4, 0, 0, l4_end),
+        insn(BPF_JMP | BPF_JGT | BPF_X, R4, R3, TO_PASS, 0),
+        insn(BPF_LDX | BPF_MEM | BPF_H, R5, R2, offsetof(ethhdr, h_proto), 0),
+        insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, TO_PASS, htons(ETH_P_IP)),
+        insn(BPF_LDX | BPF_MEM | BPF_B, R5, R2, ip_off, 0),  // version, ihl
+        insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, TO_PASS, 0x45),
+        insn(BPF_LDX | BPF_MEM | BPF_B, R5, R2, ip_off + offsetof(iphdr, protocol), 0),
+        insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, TO_PASS, IPPROTO_UDP),
+        insn(BPF_LDX | BPF_MEM | BPF_H, R5, R2, ip_off + offsetof(iphdr, frag_off), 0),
+        insn(BPF_ALU64 | BPF_AND | BPF_K, R5, 0, 0, htons(0x3fff)),
+        insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, TO_PASS, 0),
+        insn(BPF_LDX | BPF_MEM | BPF_H, R5, R2, udp_off + offsetof(udphdr, dest), 0),
+        insn(BPF_JMP | BPF_JNE | BPF_K, R5, 0, TO_PASS, htons(port)),
+        insn(BPF_LDX | BPF_MEM | BPF_W, R2, R6, offsetof(xdp_md, rx_queue_index), 0),
+        insn(BPF_LD | BPF_DW | BPF_IMM, R1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        insn(0, 0, 0, 0, 0),
+        insn(BPF_ALU64 | BPF_MOV | BPF_K, R3, 0, 0, XDP_PASS),  // action if the queue has no socket
+        insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    const int pass = static_cast<int>(prog.size());
+    prog.push_back(insn(BPF_ALU64 | BPF_MOV | BPF_K, R0, 0, 0, XDP_PASS));
+    prog.push_back(insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0));
+    for (int pc = 0; pc < pass; ++pc) {
+        if (prog[pc].off == TO_PASS && BPF_CLASS(prog[pc].code) == BPF_JMP) {
+            prog[pc].off = static_cast<int16_t>(pass - pc - 1);
+        }
+    }
+
+    static char log[16384];
+    static const char license[] = "Dual BSD/GPL";
+    bpf_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.expected_attach_type = BPF_XDP;
+    attr.insns = reinterpret_cast<uint64_t>(prog.data());
+    attr.insn_cnt = static_cast<uint32_t>(prog.size());
+    attr.license = reinterpret_cast<uint64_t>(license);
+    attr.log_buf = reinterpret_cast<uint64_t>(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    std::strncpy(attr.prog_name, "xsk_echo", sizeof(attr.prog_name) - 1);
+    const int fd = static_cast<int>(bpf(BPF_PROG_LOAD, &attr));
+    if (fd < 0) {
+        std::fprintf(stderr, "BPF_PROG_LOAD: %s\n%s", std::strerror(errno), log);
+    }
+    return fd;
+}
+
+// Native (driver) XDP unless skb_mode or the driver lacks it. Returns the
+// link fd; closing it (or exiting) detaches the program.
+static int attach_xdp_program(int prog_fd, unsigned ifindex, bool skb_mode, bool* generic)
+{
+    bpf_attr attr;
+    for (int attempt = skb_mode ? 1 : 0; attempt < 2; ++attempt) {
+        std::memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = static_cast<uint32_t>(prog_fd);
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = attempt == 0 ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+        const int fd = static_cast<int>(bpf(BPF_LINK_CREATE, &attr));
+        if (fd >= 0) {
+            *generic = attempt == 1;
+            return fd;
+        }
+        if (attempt == 0 && errno != EOPNOTSUPP && errno != EINVAL) {
+            break;
+        }
+    }
+    perror("attach XDP program (BPF_LINK_CREATE)");
+    return -1;
+}
+
+// --- echo ------------------------------------------------------------------
+
+// Turn a request frame into its reply in place. The XDP program has
+// checked the headers up to the UDP port; lengths are checked here.
+// The UDP checksum is cleared rather than kept: the timestamps change the
+// payload, and over veth the sender's checksum is often only partial
+// (offloaded), which would make a swapped copy invalid anyway.
+static bool echo_frame(ServerContext& ctx, char* frame, uint32_t len, uint64_t recv_ns)
+{
+    constexpr uint32_t headers = sizeof(ethhdr) + sizeof(iphdr) + sizeof(udphdr);
+    if (len < headers + sizeof(Msg)) {
+        return false;
+    }
+    auto* eth = reinterpret_cast<ethhdr*>(frame);
+    auto* ip = reinterpret_cast<iphdr*>(frame + sizeof(ethhdr));
+    auto* udp = reinterpret_cast<udphdr*>(frame + sizeof(ethhdr) + sizeof(iphdr));
+    const uint32_t dgram_len = ntohs(udp->len);
+    if (dgram_len < sizeof(udphdr) + sizeof(Msg) ||
+        sizeof(ethhdr) + sizeof(iphdr) + dgram_len > len) {
+        return false;
+    }
+    const uint32_t payload_len = dgram_len - sizeof(udphdr);
+    char* payload = frame + headers;
+    Msg header;
+    std::memcpy(&header, payload, sizeof(header));
+    if (header.payload_size != payload_len) {
+        return false;  // not one whole message, as the other servers treat it
+    }
+    msg_stamp_header(payload, recv_ns, now_ns());
+
+    unsigned char mac[ETH_ALEN];
+    std::memcpy(mac, eth->h_dest, ETH_ALEN);
+    std::memcpy(eth->h_dest, eth->h_source, ETH_ALEN);
+    std::memcpy(eth->h_source, mac, ETH_ALEN);
+    std::swap(ip->saddr, ip->daddr);
+    std::swap(udp->source, udp->dest);
+    udp->check = 0;
+
+    stat_add(ctx.stats->messages, 1);
+    stat_add(ctx.stats->bytes, payload_len);
+    return true;
+}
+
+// Sent frames go straight back on the fill ring
+static void recycle_completions(XskSocket& xsk)
+{
+    const uint32_t n = ring_cons_peek(xsk.comp, COMP_RING_SIZE);
+    if (n == 0) {
+        return;
+    }
+    ring_prod_free(xsk.fill, n);  // always n: fill holds every frame
+    for (uint32_t i = 0; i < n; ++i) {
+        *addr_slot(xsk.fill, xsk.fill.cached_prod + i) =
+            *addr_slot(xsk.comp, xsk.comp.cached_cons + i);
+    }
+    ring_prod_submit(xsk.fill, n);
+    ring_cons_release(xsk.comp, n);
+}
+
+// Copy mode transmits inside sendto(); zero-copy drivers only need the
+// kick when they asked for it
+static void kick_tx(ServerContext& ctx)
+{
+    XskSocket& xsk = ctx.xsk;
+    if (xsk.zero_copy && !ring_needs_wakeup(xsk.tx)) {
+        return;
+    }
+    if (sendto(xsk.fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0) < 0 && errno != EAGAIN &&
+        errno != EBUSY && errno != ENOBUFS && errno != ENETDOWN) {
+        perror("sendto xsk");
+    }
+}
+
+// One batch off the RX ring; returns the number of frames taken
+static uint32_t serve_batch(ServerContext& ctx, uint64_t recv_ns)
+{
+    XskSocket& xsk = ctx.xsk;
+    uint32_t n = ring_cons_peek(xsk.rx, BATCH_SIZE);
+    if (n == 0) {
+        return 0;
+    }
+    // A full TX ring leaves requests on the RX ring for the next round
+    n = ring_prod_free(xsk.tx, n);
+    if (n == 0) {
+        stat_add(ctx.stats->send_eagain, 1);
+        return 0;
+    }
+
+    uint32_t ntx = 0;
+    uint32_t ndrop = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        const xdp_desc* desc = desc_slot(xsk.rx, xsk.rx.cached_cons + i);
+        if (echo_frame(ctx, xsk.umem + desc->addr, desc->len, recv_ns)) {
+            xdp_desc* out = desc_slot(xsk.tx, xsk.tx.cached_prod + ntx++);
+            out->addr = desc->addr;
+            out->len = desc->len;
+            out->options = 0;
+        } else {
+            ring_prod_free(xsk.fill, ndrop + 1);
+            *addr_slot(xsk.fill, xsk.fill.cached_prod + ndrop++) = desc->addr;
+        }
+    }
+    ring_cons_release(xsk.rx, n);
+    if (ndrop > 0) {
+        ring_prod_submit(xsk.fill, ndrop);
+    }
+    if (ntx > 0) {
+        ring_prod_submit(xsk.tx, ntx);
+        kick_tx(ctx);
+    }
+    return n;
+}
+
+// Nothing received. Busy-poll mode spins, with each empty recvfrom()
+// polling the NIC queue from this thread; otherwise sleep in poll(),
+// which also wakes a driver that asked for it on the fill ring.
+static void wait_for_frames(ServerContext& ctx)
+{
+    XskSocket& xsk = ctx.xsk;
+    if (ctx.opts.busy_poll_us > 0) {
+        recvfrom(xsk.fd, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+        return;
+    }
+    stat_add(ctx.stats->recv_eagain, 1);
+    pollfd pfd = {xsk.fd, POLLIN, 0};
+    poll(&pfd, 1, IDLE_POLL_MS);
+}
+
+static void toggle_perf(ServerContext& ctx)
+{
+    if (!ctx.perf.is_open()) {
+        std::fprintf(stderr, "perf counters unavailable\n");
+        return;
+    }
+    const uint64_t now = now_ns();
+    const uint64_t messages = ctx.stats->messages.load(std::memory_order_relaxed);
+    if (!ctx.perf_counting) {
+        ctx.perf.start();
+        ctx.perf_start_ns = now;
+        ctx.perf_start_messages = messages;
+        std::printf("[perf] counting started\n");
+    } else {
+        ctx.perf.stop();
+        const PerfSample sample = ctx.perf.read();
+        const uint64_t served = messages - ctx.perf_start_messages;
+        char line[512];
+        format_perf_sample(line, sizeof(line), sample, served);
+        std::printf("[perf] %.3f s, %" PRIu64 " msgs (%s): %s\n",
+                    (now - ctx.perf_start_ns) / 1e9, served, ctx.perf.scope(), line);
+    }
+    std::fflush(stdout);
+    ctx.perf_counting = !ctx.perf_counting;
+}
+
+static void print_xdp_statistics(const XskSocket& xsk, const char* prefix)
+{
+    xdp_statistics st;
+    socklen_t len = sizeof(st);
+    std::memset(&st, 0, sizeof(st));
+    if (getsockopt(xsk.fd, SOL_XDP, XDP_STATISTICS, &st, &len) < 0) {
+        return;
+    }
+    std::printf("%s rx_dropped=%llu rx_ring_full=%llu fill_empty=%llu invalid=%llu/%llu\n",
+                prefix, static_cast<unsigned long long>(st.rx_dropped),
+                static_cast<unsigned long long>(st.rx_ring_full),
+                static_cast<unsigned long long>(st.rx_fill_ring_empty_descs),
+                static_cast<unsigned long long>(st.rx_invalid_descs),
+                static_cast<unsigned long long>(st.tx_invalid_descs));
+}
+
+static void update_stats(ServerContext& ctx, uint64_t now)
+{
+    if (now < ctx.next_report_ns) {
+        return;
+    }
+    ctx.stats->heartbeat_ns.store(now, std::memory_order_relaxed);
+    const uint64_t messages = ctx.stats->messages.load(std::memory_order_relaxed);
+    if (ctx.next_report_ns != 0 && messages != ctx.last_messages) {
+        const double elapsed_s =
+            static_cast<double>(now - (ctx.next_report_ns - STATS_REPORT_NS)) / 1e9;
+        char prefix[128];
+        std::snprintf(prefix, sizeof(prefix), "[stats] msgs/s=%.0f total_msgs=%" PRIu64,
+                      (messages - ctx.last_messages) / elapsed_s, messages);
+        print_xdp_statistics(ctx.xsk, prefix);
+        std::fflush(stdout);
+    }
+    ctx.last_messages = messages;
+    ctx.next_report_ns = now + STATS_REPORT_NS;
+}
+
+static void server_loop(ServerContext& ctx)
+{
+    while (!g_quit) {
+        const uint64_t loop_start = now_ns();
+        update_stats(ctx, loop_start);
+        stat_add(ctx.stats->loop_iterations, 1);
+        if (g_perf_toggle) {
+            g_perf_toggle = 0;
+            toggle_perf(ctx);
+        }
+
+        recycle_completions(ctx.xsk);
+        if (serve_batch(ctx, loop_start) == 0) {
+            wait_for_frames(ctx);
+            continue;
+        }
+        stats_busy_iteration(*ctx.stats, loop_start, now_ns());
+    }
+}
+
+static void print_usage(const char* prog)
+{
+    std::fprintf(stderr,
+                 "Usage: %s --dev IFACE [--queue N] [--port N] [--zero-copy|--copy] [--skb] "
+                 "[--busy-poll[=US]] [--perf]\n"
+                 "  --dev IFACE      interface to attach to\n"
+                 "  --queue N        NIC queue to serve (default 0); steer the client's "
+                 "flows to it\n"
+                 "  --port N         UDP port to echo (default %d)\n"
+                 "  --zero-copy      fail unless the driver supports zero-copy\n"
+                 "  --copy           copy mode even if zero-copy is available\n"
+                 "  --skb            generic (skb) XDP instead of native driver XDP\n"
+                 "  --busy-poll[=US] spin on the rings with SO_BUSY_POLL=US (default %d) "
+                 "and SO_PREFER_BUSY_POLL\n"
+                 "  --perf           kill -USR1 starts/stops hardware counters "
+                 "(cycles, IPC, misses)\n",
+                 prog, LISTEN_PORT, BUSY_POLL_DEFAULT_US);
+}
+
+static bool parse_options(int argc, char* argv[], ServerOptions* opts)
+{
+    static const option long_options[] = {
+        {"dev", required_argument, nullptr, 'd'},
+        {"queue", required_argument, nullptr, 'q'},
+        {"port", required_argument, nullptr, 'p'},
+        {"zero-copy", no_argument, nullptr, 'z'},
+        {"copy", no_argument, nullptr, 'c'},
+        {"skb", no_argument, nullptr, 'S'},
+        {"busy-poll", optional_argument, nullptr, 'B'},
+        {"perf", no_argument, nullptr, 'P'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "d:q:p:zcSB::Ph", long_options, nullptr)) != -1) {
+        char* end = nullptr;
+        long value = 0;
+        switch (c) {
+        case 'd':
+            opts->dev = optarg;
+            break;
+        case 'q':
+            value = std::strtol(optarg, &end, 10);
+            if (*end != '\0' || value < 0 || value > INT_MAX) {
+                std::fprintf(stderr, "queue must be a non-negative integer\n");
+                return false;
+            }
+            opts->queue = static_cast<uint32_t>(value);
+            break;
+        case 'p':
+            value = std::strtol(optarg, &end, 10);
+            if (*end != '\0' || value <= 0 || value > 65535) {
+                std::fprintf(stderr, "port must be in [1, 65535]\n");
+                return false;
+            }
+            opts->port = static_cast<uint16_t>(value);
+            break;
+        case 'z':
+            opts->copy_mode = XdpCopyMode::ZeroCopy;
+            break;
+        case 'c':
+            opts->copy_mode = XdpCopyMode::Copy;
+            break;
+        case 'S':
+            opts->skb_mode = true;
+            break;
+        case 'B':
+            value = BUSY_POLL_DEFAULT_US;
+            if (optarg != nullptr) {
+                value = std::strtol(optarg, &end, 10);
+                if (*end != '\0' || value <= 0 || value > INT_MAX) {
+                    std::fprintf(stderr, "busy-poll must be a positive number of microseconds\n");
+                    return false;
+                }
+            }
+            opts->busy_poll_us = static_cast<int>(value);
+            break;
+        case 'P':
+            opts->perf = true;
+            break;
+        default:
+            return false;
+        }
+    }
+    if (opts->dev == nullptr) {
+        std::fprintf(stderr, "--dev is required\n");
+        return false;
+    }
+    return optind == argc;
+}
+
+int main(int argc, char* argv[])
+{
+    static ServerContext ctx;
+    if (!parse_options(argc, argv, &ctx.opts)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const ServerOptions& opts = ctx.opts;
+    const unsigned ifindex = if_nametoindex(opts.dev);
+    if (ifindex == 0) {
+        std::fprintf(stderr, "unknown interface %s\n", opts.dev);
+        return 1;
+    }
+
+    bool opened = false;
+    if (opts.copy_mode != XdpCopyMode::Copy) {
+        opened = xsk_open(opts, ifindex, XDP_ZEROCOPY, &ctx.xsk);
+        if (!opened && opts.copy_mode == XdpCopyMode::ZeroCopy) {
+            std::fprintf(stderr, "zero-copy bind to %s queue %u: %s\n", opts.dev, opts.queue,
+                         std::strerror(errno));
+            return 1;
+        }
+    }
+    if (!opened && !xsk_open(opts, ifindex, XDP_COPY, &ctx.xsk)) {
+        std::fprintf(stderr, "bind to %s queue %u: %s\n", opts.dev, opts.queue,
+                     std::strerror(errno));
+        return 1;
+    }
+    if (opts.busy_poll_us > 0 && socket_busy_poll(ctx.xsk.fd, opts.busy_poll_us, 0) > 0) {
+        std::fprintf(stderr, "busy-poll: socket option refused (%s); spinning without it\n",
+                     std::strerror(errno));
+    }
+
+    const int map_fd = create_xsk_map(opts.queue + 1);
+    if (map_fd < 0) {
+        perror("BPF_MAP_CREATE xskmap");
+        return 1;
+    }
+    if (!update_xsk_map(map_fd, opts.queue, ctx.xsk.fd)) {
+        perror("BPF_MAP_UPDATE_ELEM xskmap");
+        return 1;
+    }
+    const int prog_fd = load_xdp_program(map_fd, opts.port);
+    if (prog_fd < 0) {
+        return 1;
+    }
+    bool generic = false;
+    const int link_fd = attach_xdp_program(prog_fd, ifindex, opts.skb_mode, &generic);
+    if (link_fd < 0) {
+        return 1;
+    }
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+    std::signal(SIGUSR1, on_signal);
+
+    clock_init();
+    StatsRegion* region = stats_map(STATS_SHM_NAME, true, 1);
+    if (region == nullptr) {
+        return 1;
+    }
+    ctx.stats = &region->slots[0];
+    stats_reset(*ctx.stats, now_ns());
+    if (opts.perf) {
+        // Only this thread's share: in copy mode much of the work is done
+        // in softirq context on whichever CPU takes the NIC interrupt
+        ctx.perf.open(false);
+    }
+
+    std::printf("AF_XDP echo server on %s queue %u, port %u/udp (%s, %s XDP%s)\n",
+                opts.dev, opts.queue, opts.port, ctx.xsk.zero_copy ? "zero-copy" : "copy",
+                generic ? "generic" : "native", opts.busy_poll_us > 0 ? ", busy-poll" : "");
+    std::printf("Minimum total message size: %zu bytes\n", sizeof(Msg));
+    std::printf("Timestamp clock: %s\n", clock_source_name());
+    std::printf("Live stats: ./stats_reader %s\n", STATS_SHM_NAME);
+    std::fflush(stdout);
+
+    server_loop(ctx);
+
+    std::printf("\n%" PRIu64 " messages echoed\n",
+                ctx.stats->messages.load(std::memory_order_relaxed));
+    print_xdp_statistics(ctx.xsk, "[xsk]");
+    close(link_fd);
+    close(prog_fd);
+    close(map_fd);
+    xsk_close(ctx.xsk);
+    return 0;
+}
@@ -0,0 +1,131 @@
+// shm_echo.cpp
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "common.h"
+#include "server_stats.h"
+#include "shm_ring.h"
+#include "transport.h"
+
+// Echo responder for the client's --shm transport. It runs the blocking
+// server's echo loop (echo_stream() in transport.h) over the rings in
+// shm_ring.h instead of a socket, and serves one client at a time. Run it pinned to its own
+// CPU, away from the client, for a meaningful floor.
+
+constexpr size_t RECV_BUFFER_SIZE = 64 * 1024;
+
+static volatile sig_atomic_t g_quit = 0;
+static ShmChannel* g_channel = nullptr;
+
+// Closing the channel ends the session in progress as well: the
+// transport then reads it as the peer going away
+static void on_signal(int)
+{
+    g_quit = 1;
+    if (g_channel != nullptr) {
+        g_channel->state.store(SHM_CLOSED, std::memory_order_release);
+    }
+}
+
+static void print_usage(const char* prog)
+{
+    std::fprintf(stderr,
+                 "Usage: %s [--cpu N] <shm_name>\n"
+                 "  shm_name         channel to create, e.g. /echo_shm; the client "
+                 "connects with --shm <shm_name>\n"
+                 "  --cpu N          pin the responder to CPU N\n",
+                 prog);
+}
+
+int main(int argc, char* argv[])
+{
+    static const option long_options[] = {
+        {"cpu", required_argument, nullptr, 'c'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    int cpu = -1;
+    int c;
+    while ((c = getopt_long(argc, argv, "c:h", long_options, nullptr)) != -1) {
+        char* end = nullptr;
+        long value = 0;
+        switch (c) {
+        case 'c':
+            value = std::strtol(optarg, &end, 10);
+            if (*end != '\0' || value < 0 || value >= CPU_SETSIZE) {
+                std::fprintf(stderr, "cpu must be in [0, %d)\n", CPU_SETSIZE);
+                return 1;
+            }
+            cpu = static_cast<int>(value);
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    const char* name = argv[optind];
+
+    if (cpu >= 0 && pin_current_thread(cpu) < 0) {
+        return 1;
+    }
+    clock_init();
+    ShmChannel* ch = shm_channel_map(name, true);
+    if (ch == nullptr) {
+        return 1;
+    }
+    g_channel = ch;
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    std::printf("shm echo responder on %s (%" PRIu64 " KB per direction)\n",
+                name, SHM_RING_CAPACITY / 1024);
+    std::printf("Minimum total message size: %zu bytes\n", sizeof(Msg));
+    std::printf("Timestamp clock: %s\n", clock_source_name());
+    std::fflush(stdout);
+
+    std::vector<char> buffer(RECV_BUFFER_SIZE);
+    ShmTransport transport(ch, true);
+    WorkerStats stats{};
+    while (!g_quit) {
+        // Waiting for a client is not timed, so it need not spin
+        if (ch->state.load(std::memory_order_acquire) == SHM_IDLE) {
+            const timespec wait = {0, 1000000};
+            nanosleep(&wait, nullptr);
+            continue;
+        }
+        const uint64_t before = stats.messages.load(std::memory_order_relaxed);
+        echo_stream(transport, buffer, stats);
+        const uint64_t pid = ch->client_pid.load(std::memory_order_relaxed);
+        std::printf("client %" PRIu64 " done, %" PRIu64 " messages echoed\n", pid,
+                    stats.messages.load(std::memory_order_relaxed) - before);
+        std::fflush(stdout);
+        if (g_quit) {
+            break;  // a client may still be reading; leave the rings alone
+        }
+
+        // The client has stopped touching the rings, so they can be reset
+        // under it before the channel is offered again
+        shm_ring_reset(ch->requests);
+        shm_ring_reset(ch->replies);
+        transport.sync();
+        ch->client_pid.store(0, std::memory_order_relaxed);
+        ch->state.store(SHM_IDLE, std::memory_order_release);
+    }
+
+    shm_unlink(name);
+    shm_channel_unmap(ch);
+    return 0;
+}
@@ -0,0 +1,334 @@
+// shm_ring.h
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+// Shared-memory loopback transport (client --shm, shm_echo). Two lock-free
+// single-producer/single-consumer byte rings, one per direction, carry the
+// same Msg frames a TCP connection would, as a byte stream: partial writes
+// and reads behave like send()/recv(), so the framing code in transport.h
+// runs on it unchanged. With no kernel, NIC or copy beyond two memcpys in the way,
+// the RTT measured over it is the floor set by the client and responder
+// themselves.
+//
+// Each index has one writer: head is advanced by the producer only and
+// tail by the consumer only, each on its own cache line. Endpoints keep a
+// cached copy of the other side's index and reread it only when the ring
+// looks full (or empty), so in steady state a transfer touches the shared
+// lines once. Waiting spins with a pause, then falls back to sched_yield()
+// so a responder sharing a CPU with the client still makes progress.
+constexpr uint32_t SHM_RING_MAGIC = 0x53524E47;  // "SRNG"
+constexpr uint32_t SHM_RING_VERSION = 1;
+constexpr uint64_t SHM_RING_CAPACITY = 1u << 20;  // bytes per direction, power of two
+constexpr uint32_t SHM_SPIN_LIMIT = 256;         // pause iterations (~10 us) before yielding
+constexpr uint32_t SHM_LIVENESS_SPINS = 1u << 20; // waits between peer liveness checks
+
+enum ShmChannelState : uint32_t {
+    SHM_IDLE = 0,       // responder waiting for a client
+    SHM_CONNECTED = 1,  // a client owns the channel
+    SHM_CLOSED = 2,     // the client left; the responder resets to IDLE
+};
+
+struct ShmRing {
+    alignas(64) std::atomic<uint64_t> head;  // bytes written
+    alignas(64) std::atomic<uint64_t> tail;  // bytes read
+    alignas(64) char data[SHM_RING_CAPACITY];
+};
+
+struct ShmChannel {
+    alignas(64) uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> state;
+    std::atomic<uint64_t> responder_pid;
+    std::atomic<uint64_t> client_pid;
+    ShmRing requests;  // client -> responder
+    ShmRing replies;   // responder -> client
+};
+
+static inline void shm_cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void shm_wait(uint32_t* spins)
+{
+    if (++*spins < SHM_SPIN_LIMIT) {
+        shm_cpu_relax();
+    } else {
+        sched_yield();
+    }
+}
+
+static inline bool shm_pid_alive(uint64_t pid)
+{
+    return pid != 0 && (kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM);
+}
+
+static inline void shm_ring_reset(ShmRing& ring)
+{
+    ring.head.store(0, std::memory_order_relaxed);
+    ring.tail.store(0, std::memory_order_relaxed);
+}
+
+// One end of a channel: writes into tx, reads from rx
+class ShmStream {
+public:
+    ShmStream() = default;
+    ShmStream(ShmRing* tx, ShmRing* rx)
+        : tx_(tx), rx_(rx)
+    {
+        sync();
+    }
+
+    // Reload the indices, after the rings were reset
+    void sync()
+    {
+        head_ = tx_->head.load(std::memory_order_relaxed);
+        peer_tail_ = tx_->tail.load(std::memory_order_acquire);
+        tail_ = rx_->tail.load(std::memory_order_relaxed);
+        peer_head_ = rx_->head.load(std::memory_order_acquire);
+    }
+
+    // Copy up to len bytes into the ring; returns the count, 0 when full
+    size_t write(const void* buffer, size_t len)
+    {
+        uint64_t space = SHM_RING_CAPACITY - (head_ - peer_tail_);
+        if (space < len) {
+            peer_tail_ = tx_->tail.load(std::memory_order_acquire);
+            space = SHM_RING_CAPACITY - (head_ - peer_tail_);
+        }
+        const size_t n = len < space ? len : static_cast<size_t>(space);
+        if (n == 0) {
+            return 0;
+        }
+        copy_in(tx_->data, head_, static_cast<const char*>(buffer), n);
+        head_ += n;
+        tx_->head.store(head_, std::memory_order_release);
+        return n;
+    }
+
+    // Copy up to len bytes out of the ring; returns the count, 0 when empty
+    size_t read(void* buffer, size_t len)
+    {
+        const size_t n = readable(len);
+        if (n == 0) {
+            return 0;
+        }
+        copy_out(static_cast<char*>(buffer), rx_->data, tail_, n);
+        tail_ += n;
+        rx_->tail.store(tail_, std::memory_order_release);
+        return n;
+    }
+
+    // Bytes waiting to be read, at most len
+    size_t readable(size_t len)
+    {
+        uint64_t avail = peer_head_ - tail_;
+        if (avail < len) {
+            peer_head_ = rx_->head.load(std::memory_order_acquire);
+            avail = peer_head_ - tail_;
+        }
+        return len < avail ? len : static_cast<size_t>(avail);
+    }
+
+private:
+    static void copy_in(char* ring, uint64_t pos, const char* src, size_t n)
+    {
+        const size_t offset = static_cast<size_t>(pos & (SHM_RING_CAPACITY - 1));
+        const size_t first = n < SHM_RING_CAPACITY - offset ? n : SHM_RING_CAPACITY - offset;
+        memcpy(ring + offset, src, first);
+        memcpy(ring, src + first, n - first);
+    }
+
+    static void copy_out(char* dst, const char* ring, uint64_t pos, size_t n)
+    {
+        const size_t offset = static_cast<size_t>(pos & (SHM_RING_CAPACITY - 1));
+        const size_t first = n < SHM_RING_CAPACITY - offset ? n : SHM_RING_CAPACITY - offset;
+        memcpy(dst, ring + offset, first);
+        memcpy(dst + first, ring, n - first);
+    }
+
+    ShmRing* tx_ = nullptr;
+    ShmRing* rx_ = nullptr;
+    uint64_t head_ = 0;       // our tx head, we are its only writer
+    uint64_t peer_tail_ = 0;  // cached tx tail
+    uint64_t tail_ = 0;       // our rx tail, we are its only writer
+    uint64_t peer_head_ = 0;  // cached rx head
+};
+
+// ShmStream as a transport for the framing helpers in transport.h. An
+// empty or full ring reads as EAGAIN, so the helpers wait() on it; the
+// channel leaving CONNECTED reads as a close, and a peer process that
+// died without closing it fails the next liveness check in wait().
+class ShmTransport {
+public:
+    static constexpr const char* kRecvCall = "shm read";
+    static constexpr const char* kSendCall = "shm write";
+
+    ShmTransport() = default;
+    ShmTransport(ShmChannel* ch, bool responder)
+        : ch_(ch),
+          stream_(responder ? &ch->replies : &ch->requests,
+                  responder ? &ch->requests : &ch->replies),
+          peer_pid_(responder ? &ch->client_pid : &ch->responder_pid)
+    {
+    }
+
+    ssize_t recv(void* buffer, size_t len)
+    {
+        const size_t n = stream_.read(buffer, len);
+        return n > 0 ? progress(n) : stalled(0);
+    }
+
+    ssize_t send(const void* buffer, size_t len)
+    {
+        const size_t n = stream_.write(buffer, len);
+        return n > 0 ? progress(n) : stalled(EPIPE);
+    }
+
+    static bool would_block(int err) { return err == EAGAIN; }
+
+    bool wait()
+    {
+        shm_wait(&spins_);
+        if (++waits_ % SHM_LIVENESS_SPINS == 0 &&
+            !shm_pid_alive(peer_pid_->load(std::memory_order_relaxed))) {
+            fprintf(stderr, "shm peer is gone\n");
+            errno = ECONNRESET;
+            return false;
+        }
+        return true;
+    }
+
+    // Reload the indices, after the rings were reset
+    void sync()
+    {
+        stream_.sync();
+        spins_ = 0;
+    }
+
+private:
+    ssize_t progress(size_t n)
+    {
+        spins_ = 0;
+        return static_cast<ssize_t>(n);
+    }
+
+    // Nothing moved: EAGAIN while the channel is up; once it is not, a
+    // read reports the close and a write fails with closed_errno
+    ssize_t stalled(int closed_errno)
+    {
+        if (ch_->state.load(std::memory_order_acquire) != SHM_CONNECTED) {
+            if (closed_errno == 0) {
+                return 0;
+            }
+            errno = closed_errno;
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ShmChannel* ch_ = nullptr;
+    ShmStream stream_;
+    const std::atomic<uint64_t>* peer_pid_ = nullptr;
+    uint32_t spins_ = 0;
+    uint64_t waits_ = 0;
+};
+
+// The responder creates the segment and publishes it in the IDLE state;
+// clients map it and claim it with IDLE -> CONNECTED.
+static inline ShmChannel* shm_channel_map(const char* name, bool create)
+{
+    int fd = shm_open(name, create ? (O_CREAT | O_RDWR) : O_RDWR, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return nullptr;
+    }
+    if (create && ftruncate(fd, sizeof(ShmChannel)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return nullptr;
+    }
+    // A segment the client did not create may be empty or foreign; reading
+    // its header past the end would raise SIGBUS
+    struct stat st;
+    if (!create && (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(ShmChannel)))) {
+        fprintf(stderr, "%s is not a shm channel (too small)\n", name);
+        close(fd);
+        return nullptr;
+    }
+    void* mem = mmap(nullptr, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+
+    auto* ch = static_cast<ShmChannel*>(mem);
+    if (create) {
+        shm_ring_reset(ch->requests);
+        shm_ring_reset(ch->replies);
+        ch->client_pid.store(0, std::memory_order_relaxed);
+        ch->responder_pid.store(static_cast<uint64_t>(getpid()), std::memory_order_relaxed);
+        ch->version = SHM_RING_VERSION;
+        ch->magic = SHM_RING_MAGIC;
+        ch->state.store(SHM_IDLE, std::memory_order_release);
+    } else if (ch->magic != SHM_RING_MAGIC || ch->version != SHM_RING_VERSION) {
+        fprintf(stderr, "%s is not a version %u shm channel\n", name, SHM_RING_VERSION);
+        munmap(mem, sizeof(ShmChannel));
+        return nullptr;
+    }
+    return ch;
+}
+
+static inline void shm_channel_unmap(ShmChannel* ch)
+{
+    munmap(ch, sizeof(ShmChannel));
+}
+
+// Client side: take the channel if it is free and its responder is alive
+static inline bool shm_channel_connect(ShmChannel* ch)
+{
+    if (!shm_pid_alive(ch->responder_pid.load(std::memory_order_relaxed))) {
+        fprintf(stderr, "shm responder is not running\n");
+        return false;
+    }
+    uint32_t expected = SHM_IDLE;
+    if (!ch->state.compare_exchange_strong(expected, SHM_CONNECTED,
+                                           std::memory_order_acq_rel)) {
+        fprintf(stderr, "shm channel is in use by pid %llu\n",
+                static_cast<unsigned long long>(ch->client_pid.load(std::memory_order_relaxed)));
+        return false;
+    }
+    ch->client_pid.store(static_cast<uint64_t>(getpid()), std::memory_order_relaxed);
+    return true;
+}
+
+static inline void shm_channel_close(ShmChannel* ch)
+{
+    ch->state.store(SHM_CLOSED, std::memory_order_release);
+}
+
+#endif // SHM_RING_H
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Start one server_fstack process per lcore in lcore_mask.
+# Proc 0 is the DPDK primary; the others attach as secondaries. F-Stack
+# gives each process its own RX/TX queue and the NIC's RSS spreads flows
+# across them. Proc 0 prints the aggregated [stats] line every second.
+
+conf=config.ini
+bin=./server_fstack
+
+usage() {
+    echo "Usage: $0 [-c config.ini] [-b ./server_fstack]"
+}
+
+while getopts "c:b:h" opt; do
+    case ${opt} in
+        c) conf=${OPTARG} ;;
+        b) bin=${OPTARG} ;;
+        *) usage; exit 1 ;;
+    esac
+done
+
+mask_hex=$(grep -E '^lcore_mask=' "${conf}" | head -n1 | awk -F '=' '{print $2}')
+if [ -z "${mask_hex}" ]; then
+    echo "lcore_mask not found in ${conf}"
+    exit 1
+fi
+mask=$((16#${mask_hex#0x}))
+
+num_procs=0
+for ((i = 0; i < 64; ++i)); do
+    if (( (mask >> i) & 1 )); then
+        ((num_procs++))
+    fi
+done
+
+echo "starting ${num_procs} process(es) from lcore_mask=${mask_hex}"
+for ((proc_id = 0; proc_id < num_procs; ++proc_id)); do
+    if ((proc_id == 0)); then
+        echo "${bin} --conf ${conf} --proc-type=primary --proc-id=${proc_id}"
+        ${bin} --conf "${conf}" --proc-type=primary --proc-id=${proc_id} &
+        # secondaries can only attach once the primary finished EAL init
+        sleep 5
+    else
+        echo "${bin} --conf ${conf} --proc-type=secondary --proc-id=${proc_id}"
+        ${bin} --conf "${conf}" --proc-type=secondary --proc-id=${proc_id} &
+    fi
+done
+
+wait
@@ -0,0 +1,222 @@
+// stats_reader.cpp
+#include <cerrno>
+#include <cinttypes>
+#include <climits>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "server_stats.h"
+
+// Polls the stats segment of a running server and prints per-worker rates
+// every interval. It only reads the segment, so it can be attached and
+// detached at any time without the server noticing.
+
+struct Snapshot {
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t recv_eagain;
+    uint64_t send_eagain;
+    uint64_t loop_iterations;
+    uint64_t busy_iterations;
+    uint64_t busy_ns;
+    uint64_t loop_hist[STATS_LOOP_BUCKETS];
+};
+
+static void take_snapshot(const WorkerStats& w, Snapshot* s)
+{
+    s->messages = w.messages.load(std::memory_order_relaxed);
+    s->bytes = w.bytes.load(std::memory_order_relaxed);
+    s->accepted = w.accepted.load(std::memory_order_relaxed);
+    s->closed = w.closed.load(std::memory_order_relaxed);
+    s->recv_eagain = w.recv_eagain.load(std::memory_order_relaxed);
+    s->send_eagain = w.send_eagain.load(std::memory_order_relaxed);
+    s->loop_iterations = w.loop_iterations.load(std::memory_order_relaxed);
+    s->busy_iterations = w.busy_iterations.load(std::memory_order_relaxed);
+    s->busy_ns = w.busy_ns.load(std::memory_order_relaxed);
+    for (int b = 0; b < STATS_LOOP_BUCKETS; ++b) {
+        s->loop_hist[b] = w.loop_hist[b].load(std::memory_order_relaxed);
+    }
+}
+
+// Difference of two snapshots, field by field; a worker that restarted
+// (counters went backwards) is reported from zero
+static void diff_snapshot(const Snapshot& now, const Snapshot& before, Snapshot* d)
+{
+    const bool restarted = now.messages < before.messages ||
+                           now.loop_iterations < before.loop_iterations;
+    const auto* a = reinterpret_cast<const uint64_t*>(&now);
+    const auto* b = reinterpret_cast<const uint64_t*>(&before);
+    auto* out = reinterpret_cast<uint64_t*>(d);
+    for (size_t i = 0; i < sizeof(Snapshot) / sizeof(uint64_t); ++i) {
+        out[i] = restarted ? a[i] : a[i] - b[i];
+    }
+}
+
+static void add_snapshot(Snapshot* total, const Snapshot& s)
+{
+    auto* out = reinterpret_cast<uint64_t*>(total);
+    const auto* in = reinterpret_cast<const uint64_t*>(&s);
+    for (size_t i = 0; i < sizeof(Snapshot) / sizeof(uint64_t); ++i) {
+        out[i] += in[i];
+    }
+}
+
+// Upper edge of the bucket holding the given share of busy iterations
+static uint64_t loop_percentile(const Snapshot& d, double ratio)
+{
+    if (d.busy_iterations == 0) {
+        return 0;
+    }
+    const uint64_t rank = static_cast<uint64_t>(ratio * (d.busy_iterations - 1)) + 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < STATS_LOOP_BUCKETS; ++b) {
+        seen += d.loop_hist[b];
+        if (seen >= rank) {
+            return uint64_t{1} << (b + 1);
+        }
+    }
+    return uint64_t{1} << STATS_LOOP_BUCKETS;
+}
+
+static void print_row(const char* label, uint64_t pid, const Snapshot& d, uint64_t active,
+                      double elapsed_s)
+{
+    const double busy_pct = elapsed_s > 0 ? 100.0 * d.busy_ns / (elapsed_s * 1e9) : 0.0;
+    const double bytes_per_iter =
+        d.busy_iterations ? static_cast<double>(d.bytes) / d.busy_iterations : 0.0;
+    printf("%-6s %8" PRIu64 " %10.0f %8.2f %7" PRIu64 " %9.0f %9.0f %8.0f %6.1f %9.0f "
+           "%8" PRIu64 " %8" PRIu64 "\n",
+           label, pid, d.messages / elapsed_s, d.bytes / elapsed_s / 1e6, active,
+           d.recv_eagain / elapsed_s, d.send_eagain / elapsed_s, bytes_per_iter, busy_pct,
+           d.loop_iterations / elapsed_s, loop_percentile(d, 0.5), loop_percentile(d, 0.99));
+}
+
+static bool worker_alive(uint64_t pid)
+{
+    return pid != 0 && (kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM);
+}
+
+static void print_usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [--interval MS] [--count N] <shm_name>\n"
+            "  shm_name         /kernel_echo_stats_<port>, /fstack_echo_stats, "
+            "/xdp_echo_stats or\n"
+            "                   /dpdk_echo_stats\n"
+            "  --interval MS    sampling period (default 1000)\n"
+            "  --count N        stop after N reports (default: run until killed)\n"
+            "Columns are per second over the last interval, except conns (open now),\n"
+            "B/iter (bytes received per busy loop iteration), busy%% (time in busy\n"
+            "iterations) and loop p50/p99 (busy iteration time in ns, as the upper\n"
+            "edge of its power-of-two bucket).\n",
+            prog);
+}
+
+int main(int argc, char* argv[])
+{
+    static const option long_options[] = {
+        {"interval", required_argument, nullptr, 'i'},
+        {"count", required_argument, nullptr, 'n'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    long interval_ms = 1000;
+    long count = 0;
+    int c;
+    while ((c = getopt_long(argc, argv, "i:n:h", long_options, nullptr)) != -1) {
+        char* end = nullptr;
+        switch (c) {
+        case 'i':
+            interval_ms = strtol(optarg, &end, 10);
+            if (*end != '\0' || interval_ms <= 0) {
+                fprintf(stderr, "interval must be a positive integer\n");
+                return 1;
+            }
+            break;
+        case 'n':
+            count = strtol(optarg, &end, 10);
+            if (*end != '\0' || count <= 0) {
+                fprintf(stderr, "count must be a positive integer\n");
+                return 1;
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    const StatsRegion* region = stats_map(argv[optind], false, 0);
+    if (region == nullptr) {
+        return 1;
+    }
+    const int slots = region->workers < static_cast<uint32_t>(STATS_MAX_WORKERS)
+                          ? static_cast<int>(region->workers) : STATS_MAX_WORKERS;
+
+    static Snapshot previous[STATS_MAX_WORKERS];
+    static uint64_t previous_pid[STATS_MAX_WORKERS];
+    for (int i = 0; i < slots; ++i) {
+        take_snapshot(region->slots[i], &previous[i]);
+        previous_pid[i] = region->slots[i].pid.load(std::memory_order_relaxed);
+    }
+    uint64_t last_ns = clock_monotonic_ns();
+
+    for (long report = 0; count == 0 || report < count; ++report) {
+        const timespec wait = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+        nanosleep(&wait, nullptr);
+        const uint64_t now = clock_monotonic_ns();
+        const double elapsed_s = (now - last_ns) / 1e9;
+        last_ns = now;
+
+        printf("\n%-6s %8s %10s %8s %7s %9s %9s %8s %6s %9s %8s %8s\n",
+               "worker", "pid", "msgs/s", "MB/s", "conns", "rEAGAIN/s", "sEAGAIN/s",
+               "B/iter", "busy%", "iters/s", "loop_p50", "loop_p99");
+        Snapshot total = {};
+        uint64_t total_active = 0;
+        int live = 0;
+        for (int i = 0; i < slots; ++i) {
+            const WorkerStats& w = region->slots[i];
+            const uint64_t pid = w.pid.load(std::memory_order_relaxed);
+            Snapshot current;
+            take_snapshot(w, &current);
+            if (pid != previous_pid[i]) {
+                previous[i] = Snapshot{};  // slot taken over by a new process
+                previous_pid[i] = pid;
+            }
+            Snapshot delta;
+            diff_snapshot(current, previous[i], &delta);
+            previous[i] = current;
+            if (!worker_alive(pid)) {
+                continue;
+            }
+
+            const uint64_t active = current.accepted - current.closed;
+            char label[16];
+            snprintf(label, sizeof(label), "%d", i);
+            print_row(label, pid, delta, active, elapsed_s);
+            add_snapshot(&total, delta);
+            total_active += active;
+            live++;
+        }
+        if (live == 0) {
+            printf("(no live workers)\n");
+        } else if (live > 1) {
+            print_row("total", 0, total, total_active, elapsed_s);
+        }
+        fflush(stdout);
+    }
+    return 0;
+}
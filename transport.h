@@ -0,0 +1,369 @@
+// transport.h
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <utility>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "buffer_pool.h"
+#include "common.h"
+#include "server_stats.h"
+
+// Msg framing over a byte stream, written once for every transport the
+// client and the servers run on. A transport is a small struct with
+//
+//   ssize_t recv(void* buf, size_t len);        recv(2)/send(2) semantics:
+//   ssize_t send(const void* buf, size_t len);  bytes moved, 0 = closed,
+//                                               -1 with errno
+//   ssize_t sendv(const iovec* iov, int n);     gathering send, for
+//                                               send_pending() only
+//   static bool would_block(int err);  errno meaning "nothing to do yet"
+//   bool wait();        between retries of a blocking helper below;
+//                       false gives up (peer gone, errno set)
+//   kRecvCall, kSendCall                        names for perror()
+//
+// and the helpers are templates over it, so each backend gets its own
+// copy of the loops with the calls inlined and nothing dispatched at run
+// time. Backends live next to the API they wrap: KernelSocket here,
+// ShmTransport in shm_ring.h, FStackSocket in server_fstack.cpp. The
+// io_uring server is completion-driven and frames its provided buffers
+// in place, so it shares only scan_frames()/msg_stamp_*() with the rest.
+
+// A kernel TCP socket. On a non-blocking socket (busy-poll) the blocking
+// helpers spin through EAGAIN instead of sleeping in the kernel.
+struct KernelSocket {
+    static constexpr const char* kRecvCall = "recv";
+    static constexpr const char* kSendCall = "send";
+
+    int fd = -1;
+
+    ssize_t recv(void* buffer, size_t len) { return ::recv(fd, buffer, len, 0); }
+    ssize_t send(const void* buffer, size_t len)
+    {
+        return ::send(fd, buffer, len, MSG_NOSIGNAL);
+    }
+    ssize_t sendv(const iovec* iov, int iovcnt)
+    {
+        msghdr msg{};
+        msg.msg_iov = const_cast<iovec*>(iov);
+        msg.msg_iovlen = static_cast<size_t>(iovcnt);
+        return ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+    }
+    static bool would_block(int err) { return err == EAGAIN || err == EWOULDBLOCK; }
+    bool wait() { return true; }
+};
+
+// For reporting a failed helper below
+static inline const char* transport_strerror(int err)
+{
+    return err == 0 ? "connection closed" : strerror(err);
+}
+
+// Blocking helpers: move exactly len bytes. On failure errno says why,
+// 0 for an orderly close by the peer; nothing is printed.
+template <typename Transport>
+static inline bool transport_send_all(Transport& t, const void* buffer, size_t len)
+{
+    const char* data = static_cast<const char*>(buffer);
+    while (len > 0) {
+        ssize_t n = t.send(data, len);
+        if (n > 0) {
+            data += n;
+            len -= static_cast<size_t>(n);
+        } else if (n == 0) {
+            errno = 0;
+            return false;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (!Transport::would_block(errno) || !t.wait()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Transport>
+static inline bool transport_recv_all(Transport& t, void* buffer, size_t len)
+{
+    char* data = static_cast<char*>(buffer);
+    while (len > 0) {
+        ssize_t n = t.recv(data, len);
+        if (n > 0) {
+            data += n;
+            len -= static_cast<size_t>(n);
+        } else if (n == 0) {
+            errno = 0;
+            return false;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (!Transport::would_block(errno) || !t.wait()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Read one whole frame into buffer, resized to fit it
+template <typename Transport>
+static inline bool transport_recv_message(Transport& t, std::vector<char>& buffer)
+{
+    buffer.resize(sizeof(Msg));
+    if (!transport_recv_all(t, buffer.data(), sizeof(Msg))) {
+        return false;
+    }
+
+    Msg header;
+    memcpy(&header, buffer.data(), sizeof(header));
+    if (header.payload_size < sizeof(Msg)) {
+        fprintf(stderr, "payload_size=%" PRIu32 " is smaller than header size %zu\n",
+                header.payload_size, sizeof(Msg));
+        errno = EPROTO;
+        return false;
+    }
+
+    const size_t payload_bytes = header.payload_size - sizeof(Msg);
+    buffer.resize(header.payload_size);
+    return payload_bytes == 0 ||
+           transport_recv_all(t, buffer.data() + sizeof(Msg), payload_bytes);
+}
+
+// Blocking echo of one connection (server_kernel's blocking mode,
+// shm_echo): each recv takes whatever has arrived, every complete frame
+// in it is stamped and echoed with one send, and a trailing partial frame
+// is kept. Returns when the peer closes or on an error. The buffer
+// outlives the connection, so short connections cost no allocation.
+template <typename Transport>
+static inline void echo_stream(Transport& t, std::vector<char>& buffer, WorkerStats& stats)
+{
+    size_t filled = 0;
+    uint64_t recv_ns = 0;
+    for (;;) {
+        ssize_t n = t.recv(buffer.data() + filled, buffer.size() - filled);
+        if (n == 0) {
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (Transport::would_block(errno)) {
+                if (!t.wait()) {
+                    return;
+                }
+                continue;
+            }
+            if (errno != ECONNRESET) {
+                perror(Transport::kRecvCall);
+            }
+            return;
+        }
+        const uint64_t start_ns = now_ns();
+        if (filled == 0) {
+            recv_ns = start_ns;
+        }
+        filled += static_cast<size_t>(n);
+        stat_add(stats.loop_iterations, 1);
+        stat_add(stats.bytes, static_cast<uint64_t>(n));
+
+        size_t frames = 0;
+        size_t need = 0;
+        long complete = scan_frames(buffer.data(), filled, &frames, &need);
+        if (complete < 0) {
+            fprintf(stderr, "invalid payload_size (< header size %zu)\n", sizeof(Msg));
+            return;
+        }
+        if (complete > 0) {
+            msg_stamp_frames(buffer.data(), static_cast<size_t>(complete), recv_ns, now_ns());
+            if (!transport_send_all(t, buffer.data(), static_cast<size_t>(complete))) {
+                if (errno != 0 && errno != EPIPE && errno != ECONNRESET) {
+                    perror(Transport::kSendCall);
+                }
+                return;
+            }
+            stat_add(stats.messages, frames);
+            filled -= static_cast<size_t>(complete);
+            memmove(buffer.data(), buffer.data() + complete, filled);
+            if (filled >= sizeof(Msg)) {
+                Msg header;
+                memcpy(&header, buffer.data(), sizeof(header));
+                need = header.payload_size;
+            }
+        }
+        if (need > buffer.size()) {
+            buffer.resize(need);
+        }
+        stats_busy_iteration(stats, start_ns, now_ns());
+    }
+}
+
+// Per-connection state of the event-driven servers (epoll mode, F-Stack).
+// Replies go out from two places with one gathering send: send_buffer
+// holds the frames of an earlier flush that did not fully go out, and
+// the front of recv_buffer the frames staged since, which stay where
+// they were read instead of being copied behind the others.
+struct EchoConn {
+    int fd = -1;
+    IoBuffer recv_buffer;
+    size_t recv_bytes = 0;     // stream bytes read, ready ones included
+    size_t ready = 0;          // stamped frames at the front of recv_buffer
+    IoBuffer send_buffer;
+    size_t send_size = 0;      // reply bytes in send_buffer, possibly many frames
+    size_t send_bytes = 0;
+    uint64_t recv_ns = 0;      // when the bytes in recv_buffer were first read
+};
+
+// Read whatever the transport holds, up to the free space in recv_buffer
+// Returns: -1=error/closed, 0=drained, 1=buffer full
+template <typename Transport>
+static inline int recv_available(Transport& t, EchoConn& conn, WorkerStats& stats)
+{
+    while (conn.recv_bytes < conn.recv_buffer.capacity) {
+        ssize_t n = t.recv(conn.recv_buffer.data + conn.recv_bytes,
+                           conn.recv_buffer.capacity - conn.recv_bytes);
+        if (n > 0) {
+            if (conn.recv_bytes == 0) {
+                conn.recv_ns = now_ns();
+            }
+            conn.recv_bytes += static_cast<size_t>(n);
+            stat_add(stats.bytes, static_cast<uint64_t>(n));
+        } else if (n == 0) {
+            // Normal close; not logged, as short-connection runs close
+            // tens of thousands per second (see the closed counter)
+            return -1;
+        } else {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (Transport::would_block(errno)) {
+                stat_add(stats.recv_eagain, 1);
+                return 0;
+            }
+            if (errno != ECONNRESET) {
+                perror(Transport::kRecvCall);
+            }
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+// Once send_buffer is drained, the ready frames become the next one:
+// swap the buffers and carry over only the bytes behind them
+static inline bool promote_ready(BufferPool& pool, EchoConn& conn)
+{
+    const size_t tail = conn.recv_bytes - conn.ready;
+    std::swap(conn.send_buffer, conn.recv_buffer);
+    conn.send_size = conn.ready;
+    conn.send_bytes = 0;
+    conn.recv_bytes = tail;
+    conn.ready = 0;
+    if (!pool.reserve(&conn.recv_buffer, tail, 0)) {
+        return false;
+    }
+    memcpy(conn.recv_buffer.data, conn.send_buffer.data + conn.send_size, tail);
+    return true;
+}
+
+// Stamp every complete frame read since the last call and queue it for
+// send_pending(). Returns false on a malformed frame or when a buffer
+// cannot be grown.
+static inline bool stage_replies(BufferPool& pool, EchoConn& conn, WorkerStats& stats)
+{
+    size_t frames = 0;
+    size_t need = 0;
+    long complete = scan_frames(conn.recv_buffer.data + conn.ready,
+                                conn.recv_bytes - conn.ready, &frames, &need);
+    if (complete < 0) {
+        fprintf(stderr, "client fd=%d payload_size below header size %zu\n",
+                conn.fd, sizeof(Msg));
+        return false;
+    }
+
+    if (complete > 0) {
+        const size_t done = static_cast<size_t>(complete);
+        msg_stamp_frames(conn.recv_buffer.data + conn.ready, done, conn.recv_ns, now_ns());
+        conn.ready += done;
+        stat_add(stats.messages, frames);
+        if (conn.send_bytes == conn.send_size && !promote_ready(pool, conn)) {
+            return false;
+        }
+    }
+
+    // Grow for a frame larger than a whole buffer. A smaller one that does
+    // not fit behind the ready frames waits until they are sent, when
+    // promote_ready() moves it to the front.
+    if (need > conn.recv_buffer.capacity &&
+        !pool.reserve(&conn.recv_buffer, conn.ready + need, conn.recv_bytes)) {
+        fprintf(stderr, "client fd=%d: no buffer for %zu bytes\n", conn.fd, need);
+        return false;
+    }
+    return true;
+}
+
+// Send the rest of send_buffer and the ready frames, both in each call
+// (non-blocking)
+// Returns: -1=error/closed, 0=in progress, 1=done
+template <typename Transport>
+static inline int send_pending(Transport& t, BufferPool& pool, EchoConn& conn,
+                               WorkerStats& stats)
+{
+    for (;;) {
+        if (conn.send_bytes == conn.send_size) {
+            if (conn.ready == 0) {
+                break;
+            }
+            if (!promote_ready(pool, conn)) {
+                return -1;
+            }
+        }
+
+        const size_t unsent = conn.send_size - conn.send_bytes;
+        iovec iov[2];
+        iov[0].iov_base = conn.send_buffer.data + conn.send_bytes;
+        iov[0].iov_len = unsent;
+        iov[1].iov_base = conn.recv_buffer.data;
+        iov[1].iov_len = conn.ready;
+        ssize_t n = t.sendv(iov, conn.ready > 0 ? 2 : 1);
+        if (n > 0) {
+            const size_t sent = static_cast<size_t>(n);
+            if (sent <= unsent) {
+                conn.send_bytes += sent;
+            } else {
+                conn.send_bytes = conn.send_size;
+                if (!promote_ready(pool, conn)) {
+                    return -1;
+                }
+                conn.send_bytes = sent - unsent;
+            }
+        } else if (n == 0) {
+            return -1;
+        } else {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (Transport::would_block(errno)) {
+                stat_add(stats.send_eagain, 1);
+                return 0;
+            }
+            if (errno != EPIPE && errno != ECONNRESET) {
+                perror(Transport::kSendCall);
+            }
+            return -1;
+        }
+    }
+
+    conn.send_bytes = 0;
+    conn.send_size = 0;
+    return 1;
+}
+
+#endif // TRANSPORT_H